@@ -1,9 +1,51 @@
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // dl_iterate_phdr, fileno
+#endif
+
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64 // 64-bit off_t also on 32-bit systems
+#endif
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <unistd.h>
+#define BINJECT_KERNEL_COPY
+#endif
+
+#if defined(__linux__) && defined(__ELF__)
+#include <link.h>
+#include <elf.h>
+#define BINJECT_ELF_SECTION
+#endif
+
+#if !defined(_WIN32) && (defined(__unix__) || defined(__APPLE__))
+#include <sys/mman.h>
+#include <unistd.h>
+#define BINJECT_MMAP
+#endif
+
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
 #include "binject.h"
+#include "binject_internal.h"
+
+// File positions are 64-bit everywhere
+#ifdef _WIN32
+#include <io.h>
+#define binject_fseek _fseeki64
+#define binject_ftell _ftelli64
+#else
+#define binject_fseek fseeko
+#define binject_ftell ftello
+#endif
 
 // --------------------------------------------------------------------------
 
@@ -15,42 +57,268 @@ struct binject_static_s {
   // .content considered inside the previous Flexible Array Member
 };
 
+// Content of BINJECT_STATIC_STRING
 typedef struct {
-  unsigned int tail_position;
+  unsigned int layout;               // BINJECT_LAYOUT_64
   unsigned int len;
   unsigned int max;
+  unsigned int reserved;
+  unsigned long long tail_position;
   char raw[1];
 } binject_data_t;
 
-static long int binject_find_last_tag_byte(FILE* f, const char* tag, size_t tagsize){
-  int c = '\n';
-  int count = 0;
-  long match = 0;
+// Content of BINJECT_STATIC_STRING in the binaries generated before the
+// 64-bit layout. len and max are at the same position.
+typedef struct {
+  unsigned int tail_position;
+  unsigned int len;
+  unsigned int max;
+  char raw[1];
+} binject_legacy_data_t;
 
-  long int result = -1;
-  if (tagsize <= 0) return result;
+static int binject_is_legacy(binject_data_t * data){
+  return data->layout != BINJECT_LAYOUT_64;
+}
+
+static char * binject_raw(binject_data_t * data){
+  if (binject_is_legacy(data)) return ((binject_legacy_data_t *) data)->raw;
+  return data->raw;
+}
+
+static unsigned long long binject_tail_position(binject_data_t * data){
+  if (binject_is_legacy(data)) return ((binject_legacy_data_t *) data)->tail_position;
+  return data->tail_position;
+}
+
+static binject_error_t binject_set_tail_position(binject_data_t * data, unsigned long long position){
+  if (!binject_is_legacy(data)) {
+    data->tail_position = position;
+  } else {
+    if (position > UINT_MAX) return SIZE_ERROR;
+    ((binject_legacy_data_t *) data)->tail_position = position;
+  }
+  return NO_ERROR;
+}
+
+// Fixed size trailer that can be written at end of the binary, so the static
+// data and the payload can be located without scanning the whole file
+#ifndef BINJECT_FOOTER
+#define BINJECT_FOOTER (1)
+#endif // BINJECT_FOOTER
 
-  while (!match) {
+#define BINJECT_FOOTER_MAGIC "binject\x02"
+
+#define BINJECT_FOOTER_CHECKSUM (0x01) // the checksum field is valid
+
+typedef struct {
+  unsigned long long static_offset;  // file position of the binject_static_t
+  unsigned long long tail_offset;    // file position of the tail data, 0 if unused
+  unsigned long long payload_size;   // size of the tail data or of the array content
+  unsigned int checksum;             // CRC32C of the payload
+  unsigned int flags;                // BINJECT_FOOTER_* bit mask
+  char magic[8];                     // BINJECT_FOOTER_MAGIC, without the final \0
+} binject_footer_t;
 
-    c = fgetc(f);
-    if (c == EOF) break;
+// Size of the blocks read while searching the tag in a file. It should be a
+// positive integer
+#ifndef BINJECT_SCAN_BLOCK_SIZE
+#define BINJECT_SCAN_BLOCK_SIZE (65536)
+#endif // BINJECT_SCAN_BLOCK_SIZE
 
-    if (c != tag[count]) count = 0;
-    else count += 1;
+// Size of the buffer used to copy the binary when the kernel can not do it.
+// It should be a positive integer
+#ifndef BINJECT_COPY_BLOCK_SIZE
+#define BINJECT_COPY_BLOCK_SIZE (1048576)
+#endif // BINJECT_COPY_BLOCK_SIZE
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define BINJECT_SCAN_SSE2
+#endif
+
+// Return the first occurrence of tag in buf, or NULL if not found
+static const char * binject_find_in_buffer(const char * buf, size_t size, const char * tag, size_t tagsize){
+  if (tagsize == 0 || size < tagsize) return NULL;
+  const char * last = buf + size - tagsize; // last position where a match can start
+  const char * cur = buf;
+
+#ifdef BINJECT_SCAN_SSE2
+  // Check 16 candidates at once: both the first and the last byte of the tag
+  // must match before falling back to the full comparison
+  const __m128i first = _mm_set1_epi8(tag[0]);
+  const __m128i final = _mm_set1_epi8(tag[tagsize - 1]);
+  for (; last - cur >= 15; cur += 16) {
+    __m128i head = _mm_loadu_si128((const __m128i *)cur);
+    __m128i tail = _mm_loadu_si128((const __m128i *)(cur + tagsize - 1));
+    unsigned int mask = _mm_movemask_epi8(
+      _mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, final)));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (!memcmp(cur + bit, tag, tagsize)) return cur + bit;
+      mask &= mask - 1;
+    }
+  }
+#endif // BINJECT_SCAN_SSE2
 
-    if (count >= tagsize) {
-      match = 1;
+  // Scalar search: first byte filter by memchr, then full comparison
+  while (cur <= last) {
+    cur = memchr(cur, tag[0], last - cur + 1);
+    if (!cur) break;
+    if (!memcmp(cur, tag, tagsize)) return cur;
+    cur += 1;
+  }
+  return NULL;
+}
+
+long long binject_find_last_tag_byte(FILE* f, const char* tag, size_t tagsize){
+  long long result = -1;
+  if (tagsize <= 0) return result;
+
+  // The last tagsize-1 bytes of each block are kept at the begin of the next
+  // one, so a tag that spans a block boundary is found too
+  size_t keep = 0;
+  char * buf = (char *) malloc(BINJECT_SCAN_BLOCK_SIZE + tagsize);
+  long long base = binject_ftell(f); // file position of buf[0]
+  if (!buf || base < 0) goto end;
+
+  while (1) {
+    size_t r = fread(buf + keep, 1, BINJECT_SCAN_BLOCK_SIZE, f);
+    size_t avail = keep + r;
+
+    const char * found = binject_find_in_buffer(buf, avail, tag, tagsize);
+    if (found) {
+      result = base + (found - buf) + tagsize;
       break;
     }
+    if (r == 0) break;
+
+    keep = avail < tagsize - 1 ? avail : tagsize - 1;
+    memmove(buf, buf + avail - keep, keep);
+    base += avail - keep;
   }
 
-  if (match) result = ftell(f);
-  if (result < 0) result = ACCESS_ERROR;
+  // Leave the file just after the tag, as a byte-by-byte scan would do
+  if (result >= 0 && 0 != binject_fseek(f, result, SEEK_SET)) result = -1;
 
+end:
+  free(buf);
+  if (result < 0) result = ACCESS_ERROR;
   return result;
 }
 
-static long int binject_find_static_data(binject_static_t * ds, FILE* file){
+// --------------------------------------------------------------------------
+// CRC32C (Castagnoli), with the SSE4.2 or ARMv8 instructions when available
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define BINJECT_CRC_SSE42
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define BINJECT_CRC_ARM
+#endif
+
+static unsigned int binject_crc_table[256];
+
+static unsigned int binject_crc32c_table(unsigned int crc, const unsigned char * p, size_t size){
+  if (!binject_crc_table[1]) {
+    for (unsigned int i = 255; i > 0; i--) { // [1] last, so the check above sees a complete table
+      unsigned int c = i;
+      for (int k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ 0x82f63b78u : c >> 1;
+      binject_crc_table[i] = c;
+    }
+  }
+  while (size--) crc = binject_crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#ifdef BINJECT_CRC_SSE42
+__attribute__((target("sse4.2")))
+static unsigned int binject_crc32c_sse42(unsigned int crc, const unsigned char * p, size_t size){
+#ifdef __x86_64__
+  unsigned long long wide = crc;
+  for (; size >= 8; p += 8, size -= 8) {
+    unsigned long long word;
+    memcpy(&word, p, sizeof(word));
+    wide = _mm_crc32_u64(wide, word);
+  }
+  crc = wide;
+#endif
+  for (; size >= 4; p += 4, size -= 4) {
+    unsigned int word;
+    memcpy(&word, p, sizeof(word));
+    crc = _mm_crc32_u32(crc, word);
+  }
+  while (size--) crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+#endif // BINJECT_CRC_SSE42
+
+#ifdef BINJECT_CRC_ARM
+static unsigned int binject_crc32c_arm(unsigned int crc, const unsigned char * p, size_t size){
+  for (; size >= 8; p += 8, size -= 8) {
+    unsigned long long word;
+    memcpy(&word, p, sizeof(word));
+    crc = __crc32cd(crc, word);
+  }
+  while (size--) crc = __crc32cb(crc, *p++);
+  return crc;
+}
+#endif // BINJECT_CRC_ARM
+
+unsigned int binject_crc32c(unsigned int crc, const void * data, size_t size){
+  const unsigned char * p = (const unsigned char *) data;
+#if defined(BINJECT_CRC_SSE42)
+  if (__builtin_cpu_supports("sse4.2")) return ~binject_crc32c_sse42(~crc, p, size);
+#elif defined(BINJECT_CRC_ARM)
+  return ~binject_crc32c_arm(~crc, p, size);
+#endif
+  return ~binject_crc32c_table(~crc, p, size);
+}
+
+// --------------------------------------------------------------------------
+
+// Return the position of the footer, or a negative value if the file does
+// not end with a valid one
+static long long binject_read_footer(FILE * file, binject_footer_t * footer){
+  if (0 != binject_fseek(file, -(long long)sizeof(*footer), SEEK_END)) return ACCESS_ERROR;
+  long long position = binject_ftell(file);
+  if (position < 0) return ACCESS_ERROR;
+  if (1 != fread(footer, sizeof(*footer), 1, file)) return ACCESS_ERROR;
+  if (memcmp(footer->magic, BINJECT_FOOTER_MAGIC, sizeof(footer->magic)))
+    return INVALID_DATA_ERROR;
+  if (footer->static_offset >= (unsigned long long)position
+  ||  footer->tail_offset > (unsigned long long)position)
+    return INVALID_DATA_ERROR;
+  return position;
+}
+
+static binject_error_t binject_write_footer(FILE * file, long long position, binject_footer_t * footer){
+  memcpy(footer->magic, BINJECT_FOOTER_MAGIC, sizeof(footer->magic));
+  if (0 != binject_fseek(file, position, SEEK_SET)) return ACCESS_ERROR;
+  if (1 != fwrite(footer, sizeof(*footer), 1, file)) return ACCESS_ERROR;
+  return NO_ERROR;
+}
+
+// Check that the static data tag is really at the given position
+static int binject_static_data_is_at(binject_static_t * ds, FILE * file, long long position){
+  char tag[64];
+  size_t size = ds->tag_size;
+  if (size > sizeof(tag)) size = sizeof(tag);
+  if (0 != binject_fseek(file, position + offsetof(binject_static_t, start_tag), SEEK_SET)) return 0;
+  if (size != fread(tag, 1, size, file)) return 0;
+  return !memcmp(tag, ds->start_tag, size);
+}
+
+static long long binject_find_static_data(binject_static_t * ds, FILE* file){
+
+  // Fast path: the position is stored in the footer
+  binject_footer_t footer;
+  if (0 <= binject_read_footer(file, &footer)
+  &&  binject_static_data_is_at(ds, file, footer.static_offset))
+    return footer.static_offset;
+
+  // Fallback: scan the whole file
+  if (0 != binject_fseek(file, 0, SEEK_SET)) return ACCESS_ERROR;
   return binject_find_last_tag_byte(file, ds->start_tag, ds->tag_size)
     - ds->tag_size - offsetof(binject_static_t, start_tag);
 }
@@ -59,10 +327,10 @@ static unsigned int container_size(binject_static_t * ds) {
   return ds->content_offset + ds->content_size;
 }
 
-static binject_error_t binject_write_data(binject_static_t * ds, FILE * file, long int position){
-  long int result = NO_ERROR;
+static binject_error_t binject_write_data(binject_static_t * ds, FILE * file, long long position){
+  long long result = NO_ERROR;
 
-  if (0 != fseek(file, position, SEEK_SET)) result =  ACCESS_ERROR;
+  if (0 != binject_fseek(file, position, SEEK_SET)) result =  ACCESS_ERROR;
   if (result == NO_ERROR)
     if (container_size(ds) != fwrite(ds, 1, container_size(ds), file))
       result = ACCESS_ERROR;
@@ -70,74 +338,211 @@ static binject_error_t binject_write_data(binject_static_t * ds, FILE * file, lo
   return result;
 }
 
-static int binject_tail_append(unsigned int * pos, const char * self_path, const char * data, unsigned int size){
-  FILE * f = fopen(self_path, "r+b");
-  if (!f) return ACCESS_ERROR;
+// Cut the file at the given size
+static binject_error_t binject_truncate(FILE * file, long long size){
+  if (0 != fflush(file)) return ACCESS_ERROR;
+#if defined(_WIN32)
+  return 0 == _chsize_s(_fileno(file), size) ? NO_ERROR : ACCESS_ERROR;
+#elif defined(BINJECT_MMAP)
+  return 0 == ftruncate(fileno(file), size) ? NO_ERROR : ACCESS_ERROR;
+#else
+  (void) size;
+  return ACCESS_ERROR;
+#endif
+}
 
-  if (fseek(f, 0, SEEK_END)) goto err;
-  if (pos && *pos == 0) {
-    *pos = ftell(f);
-    if (*pos < 0) goto err;
-  }
+static void binject_use_tail(binject_static_t * DS) {
+  binject_data_t * toinj = (binject_data_t *)binject_data(DS);
+  toinj->max = 0;
+}
 
-  if (size != fwrite(data, 1, size, f))
-      goto err;
+static int binject_does_use_tail(binject_static_t * DS) {
+  binject_data_t * toinj = (binject_data_t *)binject_data(DS);
+  if (toinj->max > 0) return 0;
+  return 1;
+}
 
-  fclose(f);
-  return NO_ERROR;
+#ifdef BINJECT_ELF_SECTION
 
-err:
-  fclose(f);
-  return ACCESS_ERROR;
-}
+// Name of the section that will contain the tail data after
+// binject_tail_to_section
+#ifndef BINJECT_SECTION_NAME
+#define BINJECT_SECTION_NAME ".binject"
+#endif // BINJECT_SECTION_NAME
 
-static long int binject_read_static_data(const char * path, binject_static_t * ds){
-  FILE * file = fopen(path, "rb");
-  if (!file) return ACCESS_ERROR;
+#define BINJECT_ELF_MAGIC "binjelf\x01"
 
-  long int position = binject_find_static_data(ds, file);
-  if (0 != fseek(file, position, SEEK_SET)) {
-    fclose(file);
-    return ACCESS_ERROR;
+// Written just after the data moved in the section. It is loaded in memory
+// with the data, and it contains what is needed to restore the original binary.
+typedef struct {
+  ElfW(Phdr) phdr;                // original program header, replaced by the section one
+  unsigned long long phdr_index;
+  unsigned long long shoff;       // original section header table position
+  unsigned long long shnum;       // original section header number
+  char magic[8];                  // BINJECT_ELF_MAGIC, without the final \0
+} binject_elf_undo_t;
+
+typedef struct {
+  const char * static_data;
+  unsigned long long tail_position;
+  const char * found;
+  binject_size_t size;
+} binject_elf_search_t;
+
+static int binject_elf_search_callback(struct dl_phdr_info * info, size_t size, void * data){
+  binject_elf_search_t * search = (binject_elf_search_t *) data;
+  const ElfW(Phdr) * section = NULL;
+  int owner = 0;
+
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) * ph = info->dlpi_phdr + i;
+    if (ph->p_type != PT_LOAD) continue;
+    const char * start = (const char *)(info->dlpi_addr + ph->p_vaddr);
+    if (search->static_data >= start && search->static_data < start + ph->p_memsz) owner = 1;
+    if (ph->p_offset == search->tail_position && ph->p_filesz >= sizeof(binject_elf_undo_t)) section = ph;
   }
+  if (!owner) return 0; // continue with the next object
 
-  long int result = fread(ds, 1, container_size(ds), file);
-  fclose(file);
-  return result;
+  if (section) {
+    const char * base = (const char *)(info->dlpi_addr + section->p_vaddr);
+    size_t payload = section->p_filesz - sizeof(binject_elf_undo_t);
+    binject_elf_undo_t undo;
+    memcpy(&undo, base + payload, sizeof(undo));
+    if (!memcmp(undo.magic, BINJECT_ELF_MAGIC, sizeof(undo.magic))) {
+      search->found = base;
+      search->size = payload;
+    }
+  }
+  return 1;
 }
 
-static binject_error_t binject_inject(binject_static_t * ds, const char * path){
+// Return the tail data if it was mapped in memory by the loader, i.e. if it
+// was moved in a section by binject_tail_to_section
+static char * binject_section_script(binject_static_t * DS, binject_size_t * script_size){
+  binject_data_t * data = (binject_data_t*) binject_data(DS);
+  if (binject_tail_position(data) == 0) return NULL;
 
-  FILE * file = fopen(path, "r+b");
-  if (!file) return ACCESS_ERROR;
-  
-  long int position = binject_find_static_data(ds, file);
+  binject_elf_search_t search = {
+    .static_data = (const char *) DS,
+    .tail_position = binject_tail_position(data),
+  };
+  dl_iterate_phdr(binject_elf_search_callback, &search);
 
-  binject_error_t result = INVALID_RESOURCE_ERROR;
-  if (position > 0) result = binject_write_data(ds, file, position);
-  fclose(file);
+  if (search.found && script_size) *script_size = search.size;
+  return (char *) search.found;
+}
 
-  return result;
+static binject_error_t binject_fwrite_at(FILE * file, long long position, const void * data, size_t size){
+  if (0 != binject_fseek(file, position, SEEK_SET)) return ACCESS_ERROR;
+  if (size != fwrite(data, 1, size, file)) return ACCESS_ERROR;
+  return NO_ERROR;
 }
 
-static void binject_use_tail(binject_static_t * DS) {
-  binject_data_t * toinj = (binject_data_t *)binject_data(DS);
-  toinj->max = 0;
+static binject_error_t binject_fread_at(FILE * file, long long position, void * data, size_t size){
+  if (0 != binject_fseek(file, position, SEEK_SET)) return ACCESS_ERROR;
+  if (size != fread(data, 1, size, file)) return ACCESS_ERROR;
+  return NO_ERROR;
 }
 
-static int binject_does_use_tail(binject_static_t * DS) {
-  binject_data_t * toinj = (binject_data_t *)binject_data(DS);
-  if (toinj->max > 0) return 0;
-  return 1;
+static binject_error_t binject_read_elf_header(FILE * file, ElfW(Ehdr) * ehdr){
+  if (NO_ERROR != binject_fread_at(file, 0, ehdr, sizeof(*ehdr))) return ACCESS_ERROR;
+  if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG)
+  ||  ehdr->e_ident[EI_CLASS] != (sizeof(void*) == 8 ? ELFCLASS64 : ELFCLASS32)
+  ||  ehdr->e_phentsize != sizeof(ElfW(Phdr)))
+    return INVALID_RESOURCE_ERROR;
+  return NO_ERROR;
+}
+
+// Read the original ELF header and the replaced program header of a source
+// binary whose tail was moved in a section. The phdr_position is 0 if there
+// is nothing to restore.
+static binject_error_t binject_section_undo(FILE * source, binject_footer_t * footer, ElfW(Ehdr) * ehdr, ElfW(Phdr) * phdr, long long * phdr_position){
+  binject_elf_undo_t undo;
+
+  *phdr_position = 0;
+  long long position = footer->tail_offset + footer->payload_size;
+  if (NO_ERROR != binject_fread_at(source, position, &undo, sizeof(undo))) return NO_ERROR;
+  if (memcmp(undo.magic, BINJECT_ELF_MAGIC, sizeof(undo.magic))) return NO_ERROR;
+
+  if (NO_ERROR != binject_read_elf_header(source, ehdr)) return INVALID_RESOURCE_ERROR;
+  ehdr->e_shoff = undo.shoff;
+  ehdr->e_shnum = undo.shnum;
+  *phdr = undo.phdr;
+  *phdr_position = ehdr->e_phoff + undo.phdr_index * sizeof(ElfW(Phdr));
+  return NO_ERROR;
+}
+
+// Write in the destination the original program and section headers of a
+// source binary whose tail was moved in a section
+static binject_error_t binject_section_restore(FILE * source, FILE * destination, binject_footer_t * footer){
+  ElfW(Ehdr) ehdr;
+  ElfW(Phdr) phdr;
+  long long phdr_position;
+
+  binject_error_t result = binject_section_undo(source, footer, &ehdr, &phdr, &phdr_position);
+  if (NO_ERROR != result || 0 == phdr_position) return result;
+  if (NO_ERROR != binject_fwrite_at(destination, phdr_position, &phdr, sizeof(phdr))) return ACCESS_ERROR;
+  if (NO_ERROR != binject_fwrite_at(destination, 0, &ehdr, sizeof(ehdr))) return ACCESS_ERROR;
+  return NO_ERROR;
+}
+
+// Append a named section header for the data, together with a new string table
+static binject_error_t binject_section_name(FILE * file, ElfW(Ehdr) * ehdr, ElfW(Phdr) * load, long long * end){
+  binject_error_t result = ACCESS_ERROR;
+  ElfW(Shdr) * shdr = NULL;
+  char * strtab = NULL;
+
+  // No section table to extend: the loadable segment is enough
+  if (ehdr->e_shoff == 0 || ehdr->e_shnum == 0 || ehdr->e_shstrndx >= ehdr->e_shnum
+  ||  ehdr->e_shentsize != sizeof(ElfW(Shdr)))
+    return NO_ERROR;
+
+  shdr = (ElfW(Shdr) *) malloc((ehdr->e_shnum + 1) * sizeof(ElfW(Shdr)));
+  if (!shdr) goto end;
+  if (NO_ERROR != binject_fread_at(file, ehdr->e_shoff, shdr, ehdr->e_shnum * sizeof(ElfW(Shdr)))) goto end;
+
+  ElfW(Shdr) * names = shdr + ehdr->e_shstrndx;
+  size_t oldsize = names->sh_size;
+  strtab = (char *) malloc(oldsize + sizeof(BINJECT_SECTION_NAME));
+  if (!strtab) goto end;
+  if (NO_ERROR != binject_fread_at(file, names->sh_offset, strtab, oldsize)) goto end;
+  memcpy(strtab + oldsize, BINJECT_SECTION_NAME, sizeof(BINJECT_SECTION_NAME));
+
+  ElfW(Shdr) * section = shdr + ehdr->e_shnum;
+  memset(section, 0, sizeof(*section));
+  section->sh_name = oldsize;
+  section->sh_type = SHT_PROGBITS;
+  section->sh_flags = SHF_ALLOC;
+  section->sh_addr = load->p_vaddr;
+  section->sh_offset = load->p_offset;
+  section->sh_size = load->p_filesz - sizeof(binject_elf_undo_t);
+  section->sh_addralign = 1;
+
+  names->sh_offset = *end;
+  names->sh_size = oldsize + sizeof(BINJECT_SECTION_NAME);
+  if (NO_ERROR != binject_fwrite_at(file, names->sh_offset, strtab, names->sh_size)) goto end;
+
+  ehdr->e_shoff = (names->sh_offset + names->sh_size + 7) & ~7ull;
+  ehdr->e_shnum += 1;
+  if (NO_ERROR != binject_fwrite_at(file, ehdr->e_shoff, shdr, ehdr->e_shnum * sizeof(ElfW(Shdr)))) goto end;
+  *end = ehdr->e_shoff + ehdr->e_shnum * sizeof(ElfW(Shdr));
+
+  result = NO_ERROR;
+end:
+  free(strtab);
+  free(shdr);
+  return result;
 }
 
+#endif // BINJECT_ELF_SECTION
+
 // --------------------------------------------------------------------
 
 void * binject_data(binject_static_t * ds){
   return ((char*)ds) + ds->content_offset;
 }
 
-char * binject_get_static_script(binject_static_t * DS, unsigned int * script_size, unsigned int * file_offset){
+char * binject_get_static_script64(binject_static_t * DS, binject_size_t * script_size, binject_size_t * file_offset){
 
   if (script_size) *script_size = 0;
   if (file_offset) *file_offset = 0;
@@ -145,112 +550,804 @@ char * binject_get_static_script(binject_static_t * DS, unsigned int * script_si
   binject_data_t * data = (binject_data_t*) binject_data(DS);
   if (binject_does_use_tail(DS)) {
 
-    if (file_offset) *file_offset = data->tail_position;
+    if (file_offset) *file_offset = binject_tail_position(data);
+#ifdef BINJECT_ELF_SECTION
+    return binject_section_script(DS, script_size);
+#else
     return NULL;
+#endif
 
   } else {
     if (script_size) *script_size = data->len;
-    return data->raw;
+    return binject_raw(data);
   }
 }
 
-int binject_get_tail_script(binject_static_t * DS, const char * self_path, char * buffer, unsigned int size, unsigned int offset){
+char * binject_get_static_script(binject_static_t * DS, unsigned int * script_size, unsigned int * file_offset){
+  binject_size_t size, offset;
+  char * result = binject_get_static_script64(DS, &size, &offset);
+  if (size > UINT_MAX || offset > UINT_MAX) {
+    result = NULL;
+    size = offset = 0;
+  }
+  if (script_size) *script_size = size;
+  if (file_offset) *file_offset = offset;
+  return result;
+}
+
+// Return the position where the tail data starting at offset ends: the one
+// recorded in the footer, if any, or the end of file
+static long long binject_tail_end(FILE * f, binject_size_t offset){
+  binject_footer_t footer;
+  long long end = binject_read_footer(f, &footer);
+  if (end >= 0 && footer.tail_offset == offset) {
+    end = footer.tail_offset + footer.payload_size;
+  } else {
+    if (0 != binject_fseek(f, 0, SEEK_END)) return ACCESS_ERROR;
+    end = binject_ftell(f);
+  }
+  if (end < 0 || (binject_size_t) end < offset) return ACCESS_ERROR;
+  return end;
+}
+
+long long binject_get_tail_script64(binject_static_t * DS, const char * self_path, char * buffer, binject_size_t size, binject_size_t offset){
+  long long result = ACCESS_ERROR;
 
   // Open file
   FILE * f = fopen(self_path, "rb");
   if (!f) return ACCESS_ERROR;
-  if (0 != fseek(f, offset, SEEK_SET)) return ACCESS_ERROR;
+
+  // Find the end of the data
+  long long end = binject_tail_end(f, offset);
+  if (end < 0) goto end;
+  if (size > end - offset) size = end - offset;
 
   // Read data
-  int actread = fread(buffer, 1, size, f);
-  if (0> actread && actread != size) return ACCESS_ERROR;
+  if (0 != binject_fseek(f, offset, SEEK_SET)) goto end;
+  if (size != fread(buffer, 1, size, f)) goto end;
 
   // Calc remaining bytes
-  if (0 != fseek(f, 0, SEEK_END)) return ACCESS_ERROR;
-  int result = ftell(f) - offset - actread;
+  result = end - offset - size;
+
+end:
+  fclose(f);
+  return result;
+}
+
+int binject_get_tail_script(binject_static_t * DS, const char * self_path, char * buffer, unsigned int size, unsigned int offset){
+  long long result = binject_get_tail_script64(DS, self_path, buffer, size, offset);
+  if (result > INT_MAX) return SIZE_ERROR;
+  return result;
+}
+
+FILE * binject_open_tail_script(binject_static_t * DS, const char * self_path, binject_size_t offset, binject_size_t * script_size){
+  *script_size = 0;
+
+  FILE * f = fopen(self_path, "rb");
+  if (!f) return NULL;
+
+  long long end = binject_tail_end(f, offset);
+  if (end < 0 || 0 != binject_fseek(f, offset, SEEK_SET)) {
+    fclose(f);
+    return NULL;
+  }
+  *script_size = end - offset;
+  return f;
+}
+
+int binject_verify_script(binject_static_t * DS, const char * self_path){
+  binject_footer_t footer;
+  char * buf = NULL;
+
+  FILE * f = fopen(self_path, "rb");
+  if (!f) return ACCESS_ERROR;
+
+  // Without the footer, e.g. in a truncated file, there is nothing to check against
+  int result = INVALID_RESOURCE_ERROR;
+  long long end = binject_read_footer(f, &footer);
+  if (end < 0 || !(footer.flags & BINJECT_FOOTER_CHECKSUM)) goto end;
 
-  // TODO :  close file on error ? it could override errno !
+  result = INVALID_DATA_ERROR;
+  binject_size_t size, offset;
+  unsigned int checksum = 0;
+  char * script = binject_get_static_script64(DS, &size, &offset);
+  if (script) {
+    // In the array, or in a section mapped by the loader
+    if (size != footer.payload_size) goto end;
+    checksum = binject_crc32c(0, script, size);
+  } else {
+    if (offset != footer.tail_offset || offset + footer.payload_size > (binject_size_t) end) goto end;
+    result = ACCESS_ERROR;
+    buf = (char *) malloc(BINJECT_SCAN_BLOCK_SIZE);
+    if (!buf || 0 != binject_fseek(f, offset, SEEK_SET)) goto end;
+    for (size = footer.payload_size; size > 0; ) {
+      size_t block = size < BINJECT_SCAN_BLOCK_SIZE ? size : BINJECT_SCAN_BLOCK_SIZE;
+      if (block != fread(buf, 1, block, f)) goto end;
+      checksum = binject_crc32c(checksum, buf, block);
+      size -= block;
+    }
+  }
+  result = checksum == footer.checksum ? NO_ERROR : INVALID_DATA_ERROR;
+
+end:
+  free(buf);
   fclose(f);
   return result;
 }
 
+char * binject_map_tail_script(binject_static_t * DS, const char * self_path, binject_size_t offset, binject_size_t * script_size){
+#ifndef BINJECT_MMAP
+  *script_size = 0;
+  return NULL;
+#else // BINJECT_MMAP
+  static char empty[1] = "";
+  char * result = NULL;
+
+  FILE * f = binject_open_tail_script(DS, self_path, offset, script_size);
+  if (!f) return NULL;
+  if (*script_size == 0) {
+    result = empty;
+    goto end;
+  }
+
+  // The mapping must start at a page boundary, and fit the address space
+  long int page = sysconf(_SC_PAGESIZE);
+  binject_size_t skip = page > 0 ? offset % page : 0;
+  if (*script_size + skip > (size_t) -1) goto end;
+  void * map = mmap(NULL, *script_size + skip, PROT_READ, MAP_PRIVATE, fileno(f), offset - skip);
+  if (map != MAP_FAILED) result = (char *) map + skip;
+
+end:
+  if (!result) *script_size = 0;
+  fclose(f);
+  return result;
+#endif // BINJECT_MMAP
+}
+
+void binject_unmap_tail_script(char * script, binject_size_t script_size, binject_size_t offset){
+#ifdef BINJECT_MMAP
+  if (!script || script_size == 0) return;
+  long int page = sysconf(_SC_PAGESIZE);
+  binject_size_t skip = page > 0 ? offset % page : 0;
+  munmap(script - skip, script_size + skip);
+#endif // BINJECT_MMAP
+}
+
 // --------------------------------------------------------------------
 
+// Fill the footer fields for the static data at static_offset, with the tail
+// data, if any, ending at end
+static void binject_describe_data(binject_static_t * ds, long long static_offset, long long end, binject_footer_t * footer){
+  binject_data_t * content = (binject_data_t *) binject_data(ds);
+  footer->static_offset = static_offset;
+  if (content->max > 0) {
+    footer->tail_offset = 0;
+    footer->payload_size = content->len;
+  } else {
+    footer->tail_offset = binject_tail_position(content);
+    footer->payload_size = end > (long long) footer->tail_offset ? end - footer->tail_offset : 0;
+  }
+}
+
+// Copy the first size bytes of the source in the empty destination. The
+// kernel is asked first to share the data blocks (reflink) or to copy them
+// without passing through user space; a buffered copy is the fallback.
+static binject_error_t binject_copy_file(FILE * source, FILE * destination, long long size){
+  const long long max_request = 1 << 30; // the size_t of 32-bit systems can not hold any size
+  long long done = 0;
+  int previous_errno = errno; // the failed attempts are not errors
+
+#ifdef BINJECT_KERNEL_COPY
+  int in = fileno(source);
+  int out = fileno(destination);
+
+  // Reflink, on filesystems that support it: share the whole file, then cut it
+  if (0 == ioctl(out, FICLONE, in)) {
+    if (0 == ftruncate(out, size)) return NO_ERROR;
+    if (0 != ftruncate(out, 0)) return ACCESS_ERROR;
+  }
+  errno = previous_errno;
+
+#ifdef SYS_copy_file_range
+  loff_t in_offset = 0;
+  loff_t out_offset = 0;
+  while (done < size) {
+    long long copied = syscall(SYS_copy_file_range, in, &in_offset, out, &out_offset, (size_t)(size - done < max_request ? size - done : max_request), 0);
+    if (copied <= 0) break;
+    done += copied;
+  }
+#endif // SYS_copy_file_range
+
+  // sendfile writes at the current position of the destination
+  off_t offset = done;
+  if (done < size && done == lseek(out, done, SEEK_SET)) {
+    while (done < size) {
+      ssize_t copied = sendfile(out, in, &offset, (size_t)(size - done < max_request ? size - done : max_request));
+      if (copied <= 0) break;
+      done += copied;
+    }
+  }
+  errno = previous_errno;
+  if (done == size) return NO_ERROR;
+#endif // BINJECT_KERNEL_COPY
+
+  binject_error_t result = ACCESS_ERROR;
+  char * buf = (char *) malloc(BINJECT_COPY_BLOCK_SIZE);
+  if (!buf) return ACCESS_ERROR;
+  if (0 != binject_fseek(source, done, SEEK_SET) || 0 != binject_fseek(destination, done, SEEK_SET)) goto end;
+  while (done < size) {
+    size_t block = size - done < BINJECT_COPY_BLOCK_SIZE ? size - done : BINJECT_COPY_BLOCK_SIZE;
+    if (block != fread(buf, 1, block, source)) goto end;
+    if (block != fwrite(buf, 1, block, destination)) goto end;
+    done += block;
+  }
+  result = NO_ERROR;
+
+end:
+  free(buf);
+  return result;
+}
+
+// Layout of the binary to duplicate
+typedef struct {
+  long long stop;                       // the data after it is not copied
+  long long static_offset;
+  long long footer_position;            // negative if there is no footer
+  binject_footer_t footer;
+  binject_static_t * clean_static_data; // copy of the static data, to be cleared
+} binject_source_t;
+
+static binject_error_t binject_source_open(binject_static_t * DS, FILE * fs, binject_source_t * source){
+  memset(source, 0, sizeof(*source));
+
+  // Do not copy the possible footer and final script: they must be injected again if needed.
+  source->stop = binject_tail_position( (binject_data_t *) binject_data(DS) );
+  source->footer_position = binject_read_footer(fs, &source->footer);
+  if (source->footer_position >= 0)
+    source->stop = source->footer.tail_offset > 0 ? (long long) source->footer.tail_offset : source->footer_position;
+  if (source->stop <= 0) {
+    if (0 != binject_fseek(fs, 0, SEEK_END)) return ACCESS_ERROR;
+    source->stop = binject_ftell(fs);
+    if (source->stop < 0) return ACCESS_ERROR;
+  }
+
+  // The static data of the source is at the same position in the copy. With
+  // the footer it is found without scanning the file.
+  source->clean_static_data = (binject_static_t *) malloc(container_size(DS));
+  if (!source->clean_static_data) return ACCESS_ERROR;
+  memcpy(source->clean_static_data, DS, container_size(DS));
+  source->static_offset = binject_find_static_data(source->clean_static_data, fs);
+  if (source->static_offset <= 0 || source->static_offset + (long long) container_size(DS) > source->stop)
+    return INVALID_RESOURCE_ERROR;
+  return NO_ERROR;
+}
+
+static void binject_source_close(binject_source_t * source){
+  free(source->clean_static_data);
+  source->clean_static_data = NULL;
+}
+
+// Destination of the copy of a source: an empty file or, for the images, a
+// buffer as big as the copy
+typedef struct {
+  FILE * file;
+  char * data;
+  size_t size;
+} binject_sink_t;
+
+static binject_error_t binject_sink_write(binject_sink_t * sink, long long position, const void * data, size_t size){
+  if (sink->file) {
+    if (0 != binject_fseek(sink->file, position, SEEK_SET)) return ACCESS_ERROR;
+    if (size != fwrite(data, 1, size, sink->file)) return ACCESS_ERROR;
+    return NO_ERROR;
+  }
+  if (position < 0 || (unsigned long long) position > sink->size || size > sink->size - position) return ACCESS_ERROR;
+  memcpy(sink->data + position, data, size);
+  return NO_ERROR;
+}
+
+// Copy the source in the sink, with clear static data
+static binject_error_t binject_source_copy(binject_source_t * source, FILE * fs, binject_sink_t * sink){
+  if (sink->file) {
+    if (NO_ERROR != binject_copy_file(fs, sink->file, source->stop)) return ACCESS_ERROR;
+  } else {
+    if ((unsigned long long) source->stop > sink->size) return ACCESS_ERROR;
+    if (0 != binject_fseek(fs, 0, SEEK_SET)) return ACCESS_ERROR;
+    if ((size_t) source->stop != fread(sink->data, 1, source->stop, fs)) return ACCESS_ERROR;
+  }
+
+#ifdef BINJECT_ELF_SECTION
+  // Undo the changes made by binject_tail_to_section
+  if (source->footer_position >= 0 && source->footer.tail_offset > 0) {
+    ElfW(Ehdr) ehdr;
+    ElfW(Phdr) phdr;
+    long long phdr_position;
+    if (NO_ERROR != binject_section_undo(fs, &source->footer, &ehdr, &phdr, &phdr_position)) return ACCESS_ERROR;
+    if (phdr_position > 0) {
+      if (NO_ERROR != binject_sink_write(sink, phdr_position, &phdr, sizeof(phdr))) return ACCESS_ERROR;
+      if (NO_ERROR != binject_sink_write(sink, 0, &ehdr, sizeof(ehdr))) return ACCESS_ERROR;
+    }
+  }
+#endif
+
+  // Clear the static data section
+  binject_data_t *clean_content = (binject_data_t *)binject_data(source->clean_static_data);
+  clean_content->len = 0;
+  memset(binject_raw(clean_content), 0, clean_content->max);
+  if (NO_ERROR != binject_sink_write(sink, source->static_offset, source->clean_static_data, container_size(source->clean_static_data))) return ACCESS_ERROR;
+  if (BINJECT_FOOTER) {
+    binject_footer_t footer;
+    binject_describe_data(source->clean_static_data, source->static_offset, source->stop, &footer);
+    memcpy(footer.magic, BINJECT_FOOTER_MAGIC, sizeof(footer.magic));
+    footer.checksum = binject_crc32c(0, NULL, 0);
+    footer.flags = BINJECT_FOOTER_CHECKSUM;
+    if (NO_ERROR != binject_sink_write(sink, source->stop, &footer, sizeof(footer))) return ACCESS_ERROR;
+  }
+  return NO_ERROR;
+}
+
 int binject_duplicate_binary(binject_static_t * DS, const char * self_path, const char * destination_path){
-  int r = 0;
-  int w = 0;
-  char b[128];
-  unsigned int stop = ( (binject_data_t *) binject_data(DS) ) -> tail_position;
+  binject_source_t source;
+  FILE * fd = NULL;
 
-  // Open files
   FILE * fs = fopen(self_path, "rb");
   if (!fs) return ACCESS_ERROR;
+
+  binject_error_t result = binject_source_open(DS, fs, &source);
+  if (NO_ERROR != result) goto end;
+
+  result = ACCESS_ERROR;
+  fd = fopen(destination_path, "wb");
+  if (!fd) goto end;
+  binject_sink_t sink = { fd, NULL, 0 };
+  result = binject_source_copy(&source, fs, &sink);
+
+end:
+  binject_source_close(&source);
+  if (fd && 0 != fclose(fd) && NO_ERROR == result) result = ACCESS_ERROR;
+  fclose(fs);
+  return result;
+}
+
+struct binject_image_s {
+  char * data;  // what binject_duplicate_binary writes
+  size_t size;
+};
+
+binject_image_t * binject_image_open(binject_static_t * DS, const char * self_path){
+  binject_source_t source;
+  binject_image_t * image = NULL;
+
+  // The writers can be used by several threads after this
+  binject_crc32c_table(0, NULL, 0);
+
+  FILE * fs = fopen(self_path, "rb");
+  if (!fs) return NULL;
+  if (NO_ERROR != binject_source_open(DS, fs, &source)) goto end;
+
+  // The same copy of binject_duplicate_binary, read straight in memory
+  unsigned long long size = source.stop + (BINJECT_FOOTER ? sizeof(binject_footer_t) : 0);
+  if (size > (size_t) -1) goto end;
+  image = (binject_image_t *) calloc(1, sizeof(*image));
+  if (!image) goto end;
+  image->size = size;
+  image->data = (char *) malloc(size ? size : 1);
+  binject_sink_t sink = { NULL, image->data, image->size };
+  if (!image->data || NO_ERROR != binject_source_copy(&source, fs, &sink)) {
+    binject_image_close(image);
+    image = NULL;
+  }
+
+end:
+  binject_source_close(&source);
+  fclose(fs);
+  return image;
+}
+
+int binject_image_write(binject_image_t * image, const char * destination_path){
   FILE * fd = fopen(destination_path, "wb");
   if (!fd) return ACCESS_ERROR;
+  binject_error_t result = NO_ERROR;
+  if (image->size != fwrite(image->data, 1, image->size, fd)) result = ACCESS_ERROR;
+  if (0 != fclose(fd)) result = ACCESS_ERROR;
+  return result;
+}
 
-  // Copy from source file to destination
-  unsigned int tot = 0;
-  while (tot <= stop) {
-    r = fread(b, 1, sizeof(b), fs);
-    if (0 > r) break;
-    if (stop > 0 && tot + r > stop) r = stop - tot; // Do not copy the possible final script: it must be injected again if needed.
-    w = fwrite(b, 1, r, fd);
-    if (r != sizeof(b) || r != w) break;
+void binject_image_close(binject_image_t * image){
+  if (!image) return;
+  free(image->data);
+  free(image);
+}
+
+struct binject_writer_s {
+  FILE * file;
+  binject_static_t * ds;     // copy of the static data of the file
+  long long static_offset;
+  long long end;             // end of the tail data, where the footer goes
+  long long position;        // current position of the file, -1 if unknown
+  int error;                 // first write error, the commit is not done after it
+  unsigned int checksum;     // of the tail data written so far
+  int checksum_known;        // false if the tail has data of unknown checksum
+  binject_footer_t footer;
+  int update;                // the file is cut at the end of the new data
+  binject_stage_t * stages;  // the data is passed through them, in order
+};
+
+struct binject_stage_s {
+  binject_stage_f process;
+  void * ud;
+  binject_stage_t * next;    // NULL for the last one, that emits to the writer
+  binject_writer_t * writer;
+};
+
+binject_writer_t * binject_writer_open(binject_static_t * DS, const char * destination_path){
+  binject_writer_t * writer = (binject_writer_t *) calloc(1, sizeof(*writer));
+  if (!writer) return NULL;
+  writer->position = -1;
+
+  writer->file = fopen(destination_path, "r+b");
+  if (!writer->file) goto err;
+
+  // Using the static data FROM the target binary
+  writer->ds = (binject_static_t *) malloc(container_size(DS));
+  if (!writer->ds) goto err;
+  memcpy(writer->ds, DS, container_size(DS));
+  writer->static_offset = binject_find_static_data(writer->ds, writer->file);
+  if (writer->static_offset <= 0) goto err;
+  if (0 != binject_fseek(writer->file, writer->static_offset, SEEK_SET)) goto err;
+  if (container_size(DS) != fread(writer->ds, 1, container_size(DS), writer->file)) goto err;
+
+  // The tail data overwrites the footer, that is moved after it
+  writer->end = binject_read_footer(writer->file, &writer->footer);
+  if (writer->end < 0) {
+    memset(&writer->footer, 0, sizeof(writer->footer));
+    if (0 != binject_fseek(writer->file, 0, SEEK_END)) goto err;
+    writer->end = binject_ftell(writer->file);
+    if (writer->end < 0) goto err;
   }
 
-  // Error report
-  if (r != w) return ACCESS_ERROR;
+  // Data already in the tail is included in the checksum, if it is known
+  writer->checksum_known = 1;
+  unsigned long long tail = binject_tail_position( (binject_data_t *) binject_data(writer->ds) );
+  if (binject_does_use_tail(writer->ds) && tail > 0 && tail < (unsigned long long) writer->end) {
+    writer->checksum = writer->footer.checksum;
+    writer->checksum_known = (writer->footer.flags & BINJECT_FOOTER_CHECKSUM) && writer->footer.tail_offset == tail;
+  }
+  return writer;
 
-  // TODO :  close file on error ? it could override errno !
-  fclose(fd);
-  fclose(fs);
+err:
+  if (writer->file) fclose(writer->file);
+  free(writer->ds);
+  free(writer);
+  return NULL;
+}
 
-  // Clear the static data section
-  binject_static_t *clean_static_data = (binject_static_t *) malloc(container_size(DS));
-  memcpy(clean_static_data, DS, container_size(DS));
-  binject_data_t *clean_content = (binject_data_t *)binject_data(clean_static_data);
-  clean_content->len = 0;
-  memset(clean_content->raw, 0, clean_content->max);
-  binject_inject(clean_static_data, destination_path);
-  free(clean_static_data);
+binject_writer_t * binject_writer_open_update(binject_static_t * DS, const char * destination_path){
+  binject_writer_t * writer = binject_writer_open(DS, destination_path);
+  if (!writer) return NULL;
+  binject_data_t * content = (binject_data_t *) binject_data(writer->ds);
+  if (binject_is_legacy(content)) goto err;
 
+  // The old payload starts where the runtime ends: at the tail data, if any,
+  // or at the footer
+  long long stop = writer->end;
+  unsigned long long tail = binject_does_use_tail(writer->ds) ? binject_tail_position(content) : 0;
+  if (tail > 0 && tail < (unsigned long long) writer->end) stop = tail;
+
+#ifdef BINJECT_ELF_SECTION
+  // Undo the changes made by binject_tail_to_section
+  if (writer->footer.tail_offset > 0)
+    if (NO_ERROR != binject_section_restore(writer->file, writer->file, &writer->footer)) goto err;
+#endif
+
+  // Start again from an empty array, as after binject_duplicate_binary: the
+  // size is the one of the clean static data, not the padded one
+  unsigned int max = ((binject_data_t *) binject_data(DS))->max;
+  content->len = 0;
+  content->max = writer->ds->content_size - offsetof(binject_data_t, raw);
+  if (max < content->max) content->max = max;
+  content->tail_position = 0;
+  memset(binject_raw(content), 0, content->max);
+  memset(&writer->footer, 0, sizeof(writer->footer));
+  writer->end = stop;
+  writer->position = -1;
+  writer->checksum = 0;
+  writer->checksum_known = 1;
+  writer->update = 1;
+  return writer;
+
+err:
+  fclose(writer->file);
+  free(writer->ds);
+  free(writer);
+  return NULL;
+}
+
+static binject_error_t binject_writer_tail_append(binject_writer_t * writer, const char * data, size_t size){
+  // Something other than the footer follows the tail data, e.g. it was moved
+  // in a section: it can not be extended anymore
+  binject_footer_t * footer = &writer->footer;
+  if (footer->tail_offset > 0 && footer->tail_offset + footer->payload_size != (unsigned long long) writer->end)
+    return ACCESS_ERROR;
+
+  if (writer->position != writer->end)
+    if (0 != binject_fseek(writer->file, writer->end, SEEK_SET)) return ACCESS_ERROR;
+  writer->position = -1;
+  if (size != fwrite(data, 1, size, writer->file)) return ACCESS_ERROR;
+  writer->checksum = binject_crc32c(writer->checksum, data, size);
+  writer->end += size;
+  writer->position = writer->end;
   return NO_ERROR;
 }
 
-int binject_step(binject_static_t * DS, const char * destination_path, const char * data, unsigned int r){
+static binject_error_t binject_writer_append(binject_writer_t * writer, const char * data, size_t size){
+  binject_data_t * toinj = (binject_data_t *)binject_data(writer->ds);
 
-  // Using the static data FROM the target binary
-  binject_static_t * ds = (binject_static_t *) malloc(container_size(DS));
-  memcpy(ds, DS, container_size(DS));
-  binject_read_static_data(destination_path, ds);
+  // Tail mode; with no array at all, the first chunk starts the tail
+  if (binject_does_use_tail(writer->ds)) {
+    if (binject_tail_position(toinj) == 0)
+      if (NO_ERROR != binject_set_tail_position(toinj, writer->end)) return SIZE_ERROR;
+    return binject_writer_tail_append(writer, data, size);
+  }
+
+  // Static arry mode
+  if (size < toinj->max && toinj->len + size < toinj->max-1) {
+    memcpy(binject_raw(toinj) + toinj->len, data, size);
+    toinj->len += size;
+    return NO_ERROR;
+  }
+
+  // Switch to tail mode
+  binject_use_tail(writer->ds);
+  writer->checksum = 0;
+  if (binject_tail_position(toinj) == 0)
+    if (NO_ERROR != binject_set_tail_position(toinj, writer->end)) return SIZE_ERROR;
+  binject_error_t result = binject_writer_tail_append(writer, binject_raw(toinj), toinj->len);
+  if (NO_ERROR == result) result = binject_writer_tail_append(writer, data, size);
+  return result;
+}
 
-  binject_data_t * toinj = (binject_data_t *)binject_data(ds);
-  int result = NO_ERROR;
+int binject_writer_write(binject_writer_t * writer, const char * data, size_t size){
+  if (NO_ERROR != writer->error || !data) return writer->error;
+  if (!writer->stages) {
+    writer->error = binject_writer_append(writer, data, size);
+  } else {
+    int result = writer->stages->process(writer->stages, data, size);
+    if (NO_ERROR == writer->error) writer->error = result;
+  }
+  return writer->error;
+}
+
+binject_stage_t * binject_writer_add_stage(binject_writer_t * writer, binject_stage_f process, void * ud){
+  binject_stage_t * stage = (binject_stage_t *) calloc(1, sizeof(*stage));
+  if (!stage) {
+    if (NO_ERROR == writer->error) writer->error = GENERIC_ERROR;
+    return NULL;
+  }
+  stage->process = process;
+  stage->ud = ud;
+  stage->writer = writer;
+  binject_stage_t ** last = &writer->stages;
+  while (*last) last = &(*last)->next;
+  *last = stage;
+  return stage;
+}
 
-  if (binject_does_use_tail(ds)) {
-      // Tail mode
-      result = binject_tail_append(0, destination_path, data, r);
+void * binject_stage_ud(binject_stage_t * stage){
+  return stage->ud;
+}
 
+int binject_stage_emit(binject_stage_t * stage, const char * data, size_t size){
+  binject_writer_t * writer = stage->writer;
+  if (NO_ERROR != writer->error || !data || size == 0) return writer->error;
+  if (!stage->next) {
+    writer->error = binject_writer_append(writer, data, size);
   } else {
-    if ((long)toinj->len + (long)r < (long)toinj->max-1) {
-      // Static arry mode
-      memcpy(toinj->raw + toinj->len, data, r);
-      toinj->len += r;
-      result = NO_ERROR;
-
-    } else {
-      // Switch to tail mode
-      binject_use_tail(ds);
-      unsigned int * pos = &(( (binject_data_t *) binject_data(ds) ) -> tail_position);
-      if (*pos > 0) pos = NULL;
-      result = binject_tail_append(pos, destination_path, toinj->raw, toinj->len);
-      if (NO_ERROR == result) result = binject_tail_append(pos, destination_path, data, r);
+    int result = stage->next->process(stage->next, data, size);
+    if (NO_ERROR == writer->error) writer->error = result;
+  }
+  return writer->error;
+}
+
+int binject_writer_commit(binject_writer_t * writer){
+
+  // Flush the stages: what each one emits goes through the following ones
+  // before they are flushed
+  while (writer->stages) {
+    binject_stage_t * stage = writer->stages;
+    if (NO_ERROR == writer->error) {
+      int result = stage->process(stage, NULL, 0);
+      if (NO_ERROR == writer->error) writer->error = result;
+    }
+    writer->stages = stage->next;
+    free(stage);
+  }
+
+  int result = writer->error;
+  long long size = writer->end;
+
+  // Update the footer, or create it at end of file
+  if (BINJECT_FOOTER && NO_ERROR == result) {
+    binject_footer_t * footer = &writer->footer;
+    binject_data_t * content = (binject_data_t *) binject_data(writer->ds);
+    binject_describe_data(writer->ds, writer->static_offset, writer->end, footer);
+    if (!binject_does_use_tail(writer->ds)) {
+      writer->checksum = binject_crc32c(0, binject_raw(content), content->len);
+      writer->checksum_known = 1;
     }
+    footer->checksum = writer->checksum;
+    footer->flags = writer->checksum_known ? BINJECT_FOOTER_CHECKSUM : 0;
+    result = binject_write_footer(writer->file, writer->end, footer);
+    size += sizeof(*footer);
   }
-  if (NO_ERROR == result) result = binject_inject(ds, destination_path);
-  free(ds);
+
+  // Drop what is left of a longer old payload. The static data is written
+  // last, with a single write, so it refers to the new data only when all of
+  // it is in the file.
+  if (writer->update && NO_ERROR == result) result = binject_truncate(writer->file, size);
+  if (NO_ERROR == result && 0 != fflush(writer->file)) result = ACCESS_ERROR;
+  if (NO_ERROR == result) result = binject_write_data(writer->ds, writer->file, writer->static_offset);
+
+  if (0 != fclose(writer->file) && NO_ERROR == result) result = ACCESS_ERROR;
+  free(writer->ds);
+  free(writer);
   return result;
 }
 
-// --------------------------------------------------------------------
+int binject_step(binject_static_t * DS, const char * destination_path, const char * data, size_t r){
+  binject_writer_t * writer = binject_writer_open(DS, destination_path);
+  if (!writer) return ACCESS_ERROR;
+  binject_writer_write(writer, data, r);
+  return binject_writer_commit(writer);
+}
+
+#ifdef BINJECT_ELF_SECTION
 
+#ifndef NT_GNU_ABI_TAG
+#define NT_GNU_ABI_TAG (1)
+#endif // NT_GNU_ABI_TAG
+#ifndef NT_GNU_BUILD_ID
+#define NT_GNU_BUILD_ID (3)
+#endif // NT_GNU_BUILD_ID
+
+// Check if a note segment holds the GNU ABI tag or build-id, that the loader
+// and the debuggers look for. It is assumed so if it can not be parsed.
+static int binject_note_is_needed(FILE * file, ElfW(Phdr) * note){
+  const size_t align = note->p_align == 8 ? 8 : 4;
+  int result = 1;
+  if (note->p_filesz > 65536) return result;
+  char * data = (char *) malloc(note->p_filesz + 1);
+  if (!data) return result;
+  if (NO_ERROR != binject_fread_at(file, note->p_offset, data, note->p_filesz)) goto end;
+
+  size_t position = 0;
+  while (position < note->p_filesz) {
+    ElfW(Nhdr) header;
+    if (note->p_filesz - position < sizeof(header)) goto end;
+    memcpy(&header, data + position, sizeof(header));
+    size_t name = position + sizeof(header);
+    size_t namesz = (header.n_namesz + align - 1) & ~(align - 1);
+    size_t descsz = (header.n_descsz + align - 1) & ~(align - 1);
+    if (namesz > note->p_filesz - name || descsz > note->p_filesz - name - namesz) goto end;
+    if (header.n_namesz == 4 && !memcmp(data + name, "GNU", 4)
+    && (header.n_type == NT_GNU_ABI_TAG || header.n_type == NT_GNU_BUILD_ID))
+      goto end;
+    position = name + namesz + descsz;
+  }
+  result = 0;
+
+end:
+  free(data);
+  return result;
+}
+
+// Find a program header that can be replaced: a note after all the loadable
+// segments, since the new one maps the highest addresses. The best is a note
+// whose data is covered by another header too, e.g. the .note.gnu.property
+// one, also in PT_GNU_PROPERTY; else one that is not needed. -1 if none.
+static int binject_free_note(FILE * file, ElfW(Phdr) * phdr, int phnum){
+  int first = 0;
+  for (int i = 0; i < phnum; i++)
+    if (phdr[i].p_type == PT_LOAD) first = i + 1;
+
+  int result = -1;
+  for (int i = first; i < phnum; i++) {
+    if (phdr[i].p_type != PT_NOTE) continue;
+    for (int j = 0; j < phnum; j++)
+      if (j != i && phdr[j].p_type != PT_LOAD && phdr[j].p_offset == phdr[i].p_offset && phdr[j].p_filesz == phdr[i].p_filesz)
+        return i;
+    if (result < 0 && !binject_note_is_needed(file, phdr + i)) result = i;
+  }
+  return result;
+}
+
+#endif // BINJECT_ELF_SECTION
+
+int binject_tail_to_section(binject_static_t * DS, const char * destination_path){
+#ifndef BINJECT_ELF_SECTION
+  return INVALID_RESOURCE_ERROR;
+#else
+  binject_error_t result = ACCESS_ERROR;
+  ElfW(Phdr) * phdr = NULL;
+  ElfW(Ehdr) ehdr;
+  binject_footer_t footer;
+
+  FILE * file = fopen(destination_path, "r+b");
+  if (!file) return ACCESS_ERROR;
+
+  // Find the tail data; with no tail the data is already in the loaded array
+  long long end = binject_read_footer(file, &footer);
+  if (end < 0) {
+    memset(&footer, 0, sizeof(footer)); // no checksum
+    binject_static_t * ds = (binject_static_t *) malloc(container_size(DS));
+    if (!ds) goto end;
+    memcpy(ds, DS, container_size(DS));
+    footer.static_offset = binject_find_static_data(ds, file);
+    if (0 <= (long long)footer.static_offset && NO_ERROR == binject_fread_at(file, footer.static_offset, ds, container_size(ds))) {
+      footer.tail_offset = binject_does_use_tail(ds) ? binject_tail_position( (binject_data_t *) binject_data(ds) ) : 0;
+      if (0 == binject_fseek(file, 0, SEEK_END)) end = binject_ftell(file);
+      footer.payload_size = end - footer.tail_offset;
+    }
+    free(ds);
+    if (end < 0 || 0 > (long long)footer.static_offset) goto end;
+  }
+  result = NO_ERROR;
+  if (footer.tail_offset == 0) goto end;
+  result = INVALID_RESOURCE_ERROR;
+  if (footer.tail_offset + footer.payload_size != (unsigned long long) end) goto end;
+
+  // Find a free program header
+  result = binject_read_elf_header(file, &ehdr);
+  if (NO_ERROR != result) goto end;
+  result = ACCESS_ERROR;
+  phdr = (ElfW(Phdr) *) malloc(ehdr.e_phnum * sizeof(ElfW(Phdr)));
+  if (!phdr) goto end;
+  if (NO_ERROR != binject_fread_at(file, ehdr.e_phoff, phdr, ehdr.e_phnum * sizeof(ElfW(Phdr)))) goto end;
+
+  int index = binject_free_note(file, phdr, ehdr.e_phnum);
+  unsigned long long align = 4096;
+  unsigned long long top = 0;
+  for (int i = 0; i < ehdr.e_phnum; i++) {
+    if (phdr[i].p_type != PT_LOAD) continue;
+    if (phdr[i].p_align > align) align = phdr[i].p_align;
+    if (phdr[i].p_vaddr + phdr[i].p_memsz > top) top = phdr[i].p_vaddr + phdr[i].p_memsz;
+  }
+  result = INVALID_RESOURCE_ERROR;
+  if (index < 0) goto end;
+
+  binject_elf_undo_t undo;
+  undo.phdr = phdr[index];
+  undo.phdr_index = index;
+  undo.shoff = ehdr.e_shoff;
+  undo.shnum = ehdr.e_shnum;
+  memcpy(undo.magic, BINJECT_ELF_MAGIC, sizeof(undo.magic));
+
+  // Map the data, followed by the undo information, above any other segment
+  ElfW(Phdr) * load = phdr + index;
+  memset(load, 0, sizeof(*load));
+  load->p_type = PT_LOAD;
+  load->p_flags = PF_R;
+  load->p_offset = footer.tail_offset;
+  load->p_vaddr = ((top + align - 1) & ~(align - 1)) + (footer.tail_offset & (align - 1));
+  load->p_paddr = load->p_vaddr;
+  load->p_filesz = footer.payload_size + sizeof(undo);
+  load->p_memsz = load->p_filesz;
+  load->p_align = align;
+
+  result = ACCESS_ERROR;
+  if (NO_ERROR != binject_fwrite_at(file, end, &undo, sizeof(undo))) goto end;
+  end += sizeof(undo);
+  if (NO_ERROR != binject_section_name(file, &ehdr, load, &end)) goto end;
+  if (NO_ERROR != binject_write_footer(file, end, &footer)) goto end;
+  if (NO_ERROR != binject_fwrite_at(file, ehdr.e_phoff + index * sizeof(ElfW(Phdr)), load, sizeof(*load))) goto end;
+  if (NO_ERROR != binject_fwrite_at(file, 0, &ehdr, sizeof(ehdr))) goto end;
+  result = NO_ERROR;
+
+end:
+  free(phdr);
+  fclose(file);
+  return result;
+#endif // BINJECT_ELF_SECTION
+}
+
+// --------------------------------------------------------------------
@@ -3,6 +3,7 @@
 #define _BINJECT_H_
 
 #include <stddef.h>
+#include <stdio.h>
 
 // --------------------------------------------------------------------------
 
@@ -15,6 +16,9 @@ typedef enum {
   INVALID_DATA_ERROR = -5,
 } binject_error_t;
 
+// Sizes and file offsets of the 64-bit API
+typedef unsigned long long binject_size_t;
+
 // --------------------------------------------------------------------------
 // Handle custom struct static data
 
@@ -29,8 +33,8 @@ typedef struct binject_static_s binject_static_t;
 // T: in-file mark (string literal)
 // S: type of the content data
 // N: identifier of the binject_static_t * variable that will be defined
-// V: initialization data as C struct literal 
-#define BINJECT_STATIC_DATA(T, S, N, V) \
+// ...: initialization data as C struct literal (it can contain commas)
+#define BINJECT_STATIC_DATA(T, S, N, ...) \
 typedef struct {                  \
   unsigned int tag_size;          \
   unsigned int content_size;      \
@@ -43,7 +47,7 @@ static N ## _t N ## _istance = {  \
   .content_size = sizeof(S),      \
   .content_offset = offsetof(N ## _t, content),\
   .start_tag = T,                 \
-  .content = V,                   \
+  .content = __VA_ARGS__,         \
 };                                \
 binject_static_t * N = (binject_static_t*) & N ## _istance
 
@@ -56,18 +60,24 @@ binject_static_t * N = (binject_static_t*) & N ## _istance
 //   unsigned int size;
 //   char * content = binject_info(the_data, &size);
 
+// The first field marks the 64-bit layout. In the binaries generated before
+// it, the first field is the 32-bit tail position, and the array follows max.
+#define BINJECT_LAYOUT_64 (0xb1e64a7fu)
+
 // This MUST be instantiated as the STATIC values (i.e. global/top-level)
 // T: in-file mark (string literal)
 // S: size of the char[] content
 // N: identifier of the binject_static_t * variable that will be defined
 #define BINJECT_STATIC_STRING(T, S, N) \
 typedef struct { \
-  unsigned int tail_position; \
+  unsigned int layout; \
   unsigned int len; \
   unsigned int max; \
+  unsigned int reserved; \
+  unsigned long long tail_position; \
   char raw[S]; \
 } N ## _inner_t; \
-BINJECT_STATIC_DATA(T, N ## _inner_t, N, {.max = S})
+BINJECT_STATIC_DATA(T, N ## _inner_t, N, {.layout = BINJECT_LAYOUT_64, .max = S})
 
 // -------------------------------------------------------------------------
 // API functions for Read
@@ -76,11 +86,79 @@ void * binject_data(binject_static_t * ds);
 char * binject_get_static_script(binject_static_t * DS, unsigned int * script_size, unsigned int * file_offset);
 int binject_get_tail_script(binject_static_t * DS, const char * self_path, char * buffer, unsigned int size, unsigned int offset);
 
+// 64-bit versions of the previous ones. The 32-bit ones fail (NULL or
+// SIZE_ERROR) when the script size or position does not fit.
+char * binject_get_static_script64(binject_static_t * DS, binject_size_t * script_size, binject_size_t * file_offset);
+long long binject_get_tail_script64(binject_static_t * DS, const char * self_path, char * buffer, binject_size_t size, binject_size_t offset);
+
+// Open the binary with the position set at the begin of the tail script, for
+// sequential reads. NULL is returned on error.
+FILE * binject_open_tail_script(binject_static_t * DS, const char * self_path, binject_size_t offset, binject_size_t * script_size);
+
+// Map the tail script in memory, read only. NULL is returned on error or
+// where memory mapping is not available: binject_open_tail_script can be used
+// instead. The result must be released with binject_unmap_tail_script.
+char * binject_map_tail_script(binject_static_t * DS, const char * self_path, binject_size_t offset, binject_size_t * script_size);
+void binject_unmap_tail_script(char * script, binject_size_t script_size, binject_size_t offset);
+
+// Check the script against the checksum written in the footer at injection.
+// INVALID_DATA_ERROR is returned if it does not match, INVALID_RESOURCE_ERROR
+// if there is no checksum, e.g. the footer is disabled or the file is truncated.
+int binject_verify_script(binject_static_t * DS, const char * self_path);
+
+// CRC32C of the data, continuing from crc (0 for the first block)
+unsigned int binject_crc32c(unsigned int crc, const void * data, size_t size);
+
 // -------------------------------------------------------------------------
 // API functions for Write
 
 int binject_duplicate_binary(binject_static_t * DS, const char * self_path, const char * destination_path);
-int binject_step(binject_static_t * DS, const char * destination_path, const char * data, unsigned int r);
+
+// Runtime image, to generate many binaries reading the source only once: each
+// binject_image_write is equivalent to a binject_duplicate_binary. After the
+// open, the writes and the binject_writer_* functions on different
+// destinations can be called by several threads.
+typedef struct binject_image_s binject_image_t;
+
+binject_image_t * binject_image_open(binject_static_t * DS, const char * self_path);
+int binject_image_write(binject_image_t * image, const char * destination_path);
+void binject_image_close(binject_image_t * image);
+
+int binject_step(binject_static_t * DS, const char * destination_path, const char * data, size_t r);
+
+// Inject any number of chunks keeping the destination open: the static data
+// is located once, and it is written back only by the commit. The commit
+// closes the writer also on error, and no data is committed after a failed
+// write. binject_step is a single chunk shortcut.
+typedef struct binject_writer_s binject_writer_t;
+typedef struct binject_stage_s binject_stage_t;
+
+binject_writer_t * binject_writer_open(binject_static_t * DS, const char * destination_path);
+int binject_writer_write(binject_writer_t * writer, const char * data, size_t size);
+int binject_writer_commit(binject_writer_t * writer);
+
+// Transform pipeline: the data passed to binject_writer_write after a stage is
+// added goes through it, and through the ones added later, in order. The
+// process function of a stage gets the chunks as they stream through, and it
+// passes its output on with binject_stage_emit. At commit, it is called a last
+// time with NULL data, to emit what it holds. The ud is owned by the caller.
+typedef int (*binject_stage_f)(binject_stage_t * stage, const char * data, size_t size);
+
+binject_stage_t * binject_writer_add_stage(binject_writer_t * writer, binject_stage_f process, void * ud);
+void * binject_stage_ud(binject_stage_t * stage);
+int binject_stage_emit(binject_stage_t * stage, const char * data, size_t size);
+
+// Like binject_writer_open, but on a binary generated before: its script is
+// replaced in place, without copying the runtime again. The array is written
+// again or the tail data is overwritten, and the commit cuts what is left of
+// the old one. NULL is returned if the binary can not be updated, e.g. it was
+// generated by an older version: binject_duplicate_binary can be used instead.
+binject_writer_t * binject_writer_open_update(binject_static_t * DS, const char * destination_path);
+
+// Move the tail data in a section mapped in memory by the loader (ELF only).
+// It must be called after the last binject_step. INVALID_RESOURCE_ERROR is
+// returned, with the tail left as it is, if no program header can be reused.
+int binject_tail_to_section(binject_static_t * DS, const char * destination_path);
 
 // -------------------------------------------------------------------------
 
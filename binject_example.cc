@@ -1,6 +1,7 @@
 
 #include "binject.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include "unistd.h"
@@ -29,15 +30,36 @@ static int aux_print_help(const char * command){
   return 0;
 }
 
-static char * aux_script_prepare(char * buf, int * off, int * siz){
-  *off = *siz; // buffer processing finished
-  return buf;
+// Size of the chunks read from the script and passed to the injection
+#ifndef BINJECT_CHUNK_SIZE
+#define BINJECT_CHUNK_SIZE (16384)
+#endif // BINJECT_CHUNK_SIZE
+
+// Stages of the injection pipeline: each one gets the chunks of the script as
+// they stream through, and emits them, transformed, to the following one. Add
+// here the ones you need, e.g. to minify or compress the script.
+
+typedef struct {
+  unsigned int crc;
+  binject_size_t size;
+} aux_checksum_t;
+
+// Pass the data unchanged, and report its checksum at end
+static int aux_stage_checksum(binject_stage_t * stage, const char * data, size_t size){
+  aux_checksum_t * checksum = (aux_checksum_t *) binject_stage_ud(stage);
+  if (!data) {
+    printf("Injected %llu byte, CRC32C %08x\n", checksum->size, checksum->crc);
+    return NO_ERROR;
+  }
+  checksum->crc = binject_crc32c(checksum->crc, data, size);
+  checksum->size += size;
+  return binject_stage_emit(stage, data, size);
 }
 
-static int aux_script_run(const char * scr, int size, int argc, char ** argv){
+static int aux_script_run(const char * scr, binject_size_t size, int argc, char ** argv){
   // Script echo
-  printf("A %d byte script was found (dump:)[", size);
-  int w = fwrite(scr, 1, size, stdout);
+  printf("A %llu byte script was found (dump:)[", size);
+  size_t w = fwrite(scr, 1, size, stdout);
   if (w != size) return ACCESS_ERROR;
   printf("]\n");
   return 0;
@@ -47,38 +69,34 @@ static int aux_script_run(const char * scr, int size, int argc, char ** argv){
 
 static int binject_main_app_internal_script_inject(binject_static_t * info, const char * scr_path, const char* bin_path, const char * outpath){
   int result = ACCESS_ERROR;
+  char buf[BINJECT_CHUNK_SIZE];
+  size_t siz;
+  aux_checksum_t checksum = {0, 0};
+  binject_writer_t * writer = NULL;
 
   // Open the scipt
   FILE * scr = fopen(scr_path, "rb");
   if (!scr) goto end;
 
-  // Get the original binary size
-  if (fseek(scr, 0, SEEK_END)) goto end;
-
-  { // Scope block to avoid goto and variable length issue
-    int siz = ftell(scr);
-    if (siz < 0) goto end;
-    if (fseek(scr, 0, SEEK_SET)) goto end;
+  // Copy the binary
+  result = binject_duplicate_binary(info, bin_path, outpath);
+  if (NO_ERROR != result) goto end;
 
-    int bufsize = siz;
-    int off = 0;
-    char buf[bufsize];
+  // Prepare the pipeline for the injection
+  writer = binject_writer_open(info, outpath);
+  result = ACCESS_ERROR;
+  if (!writer) goto end;
+  binject_writer_add_stage(writer, aux_stage_checksum, &checksum);
 
-    // Copy the binary
-    result = binject_duplicate_binary(info, bin_path, outpath);
-    if (NO_ERROR != result) goto end;
+  // Inject the script one chunk at time
+  result = NO_ERROR;
+  while (NO_ERROR == result && 0 < (siz = fread(buf, 1, sizeof(buf), scr)))
+    result = binject_writer_write(writer, buf, siz);
+  if (NO_ERROR == result && ferror(scr)) result = ACCESS_ERROR;
 
-    // Prepare the script for the injection
-    if (0> fread(buf, 1, siz, scr)) goto end;
-    while (off >=0 && off < siz) {
-      char * injdat = buf;
-      injdat = aux_script_prepare(injdat, &off, &siz);
-
-      // Inject the partial script and update static info into the binary
-      result = binject_step(info, outpath, injdat, siz);
-      if (NO_ERROR != result) goto end;
-    }
-  }
+  // Update static info into the binary
+  if (NO_ERROR == result) result = binject_writer_commit(writer);
+  else binject_writer_commit(writer);
 
 end:
   error_report(0);
@@ -87,11 +105,11 @@ end:
 }
 
 static int binject_main_app_internal_script_handle(binject_static_t * info, const char* bin_path, int argc, char **argv) {
-  unsigned int size;
-  unsigned int offset;
+  binject_size_t size;
+  binject_size_t offset;
 
   // Get information from static section
-  char * script = binject_get_static_script(info, &size, &offset);
+  char * script = binject_get_static_script64(info, &size, &offset);
 
   if (script) {
     // Script found in the static section
@@ -99,10 +117,24 @@ static int binject_main_app_internal_script_handle(binject_static_t * info, cons
 
   } else {
     // Script should be at end of the binary
-    unsigned int script_size = binject_get_tail_script(info, bin_path, 0, 0, offset);
-    char buf[script_size];
-    binject_get_tail_script(info, bin_path, buf, script_size, offset);
-    return aux_script_run(buf, script_size, argc, argv);
+    binject_size_t script_size = 0;
+    char * buf = binject_map_tail_script(info, bin_path, offset, &script_size);
+    if (buf) {
+      int result = aux_script_run(buf, script_size, argc, argv);
+      binject_unmap_tail_script(buf, script_size, offset);
+      return result;
+    }
+
+    // Memory mapping not available: read it
+    long long remaining = binject_get_tail_script64(info, bin_path, 0, 0, offset);
+    if (remaining < 0) return remaining;
+    script_size = remaining;
+    buf = (char *) malloc(script_size + 1);
+    if (!buf) return ACCESS_ERROR;
+    binject_get_tail_script64(info, bin_path, buf, script_size, offset);
+    int result = aux_script_run(buf, script_size, argc, argv);
+    free(buf);
+    return result;
   }
 
   return NO_ERROR;
@@ -112,9 +144,9 @@ int main(int argc, char **argv) {
   int result = GENERIC_ERROR;
 
   // Get information from static section
-  unsigned int size = 0;
-  unsigned int offset = 0;
-  binject_get_static_script(static_data, &size, &offset);
+  binject_size_t size = 0;
+  binject_size_t offset = 0;
+  binject_get_static_script64(static_data, &size, &offset);
 
   // Run the proper tool
   if (size > 0 || offset > 0) {
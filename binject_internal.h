@@ -0,0 +1,19 @@
+
+#ifndef _BINJECT_INTERNAL_H_
+#define _BINJECT_INTERNAL_H_
+
+#include "binject.h"
+
+// --------------------------------------------------------------------------
+// Internals of binject.c reached by the tests and the benchmarks. They are
+// not part of the API, and they can change at any time.
+
+// Scan the file from the current position: the position just after the first
+// occurrence of the tag is returned (and the file is left there), or a
+// negative value if it is not found
+long long binject_find_last_tag_byte(FILE * f, const char * tag, size_t tagsize);
+
+// --------------------------------------------------------------------------
+
+#endif // _BINJECT_INTERNAL_H_
+
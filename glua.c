@@ -1,15 +1,12 @@
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
+#include "glua_internal.h"
+
 #include <errno.h>
 #include <signal.h>
-#include "unistd.h"
+#include <time.h>
 
-#include "lua.h"
 #include "lualib.h"
-#include "lauxlib.h"
-#include "binject.h"
+#include "glua_lz.h"
 
 // --------------------------------------------------------------------------------
 
@@ -18,19 +15,292 @@
 #define FAIL_EXECUTION -127
 #define ALL_IS_RIGHT 0
 
-#ifdef LUA_OK
- #define is_lua_ok(status_code) (LUA_OK == status_code)
+void luaL_openlibs (lua_State *L); // Lua internal - not part of the lua API
+
+unsigned int glua_hash(const char * name, size_t size) {
+  unsigned int hash = 2166136261u; // FNV-1a
+  for (size_t i = 0; i < size; i++) hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+  return hash;
+}
+
+// --------------------------------------------------------------------------------
+
+// Startup tracing. When the GLUA_TRACE environment variable is set, each phase
+// of the startup and each require are timed, and at exit they are written in
+// the Chrome trace event format (chrome://tracing, Perfetto) to the file it
+// names, or to the standard error if it is "1" or "stderr". When it is not
+// set, a trace point costs a single test.
+
+typedef struct {
+  char * name;
+  const char * category;
+  double start;     // microseconds
+  double duration;  // negative while the event is open
+  int depth;        // number of events open when it began
+} trace_event_t;
+
+static struct {
+  int enabled;      // negative until GLUA_TRACE is read
+  const char * output;
+  trace_event_t * events;
+  int count;
+  int capacity;
+  int depth;
+} glua_trace = { -1 };
+
+static double trace_now(void) {
+#if defined(CLOCK_MONOTONIC)
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+#elif defined(TIME_UTC)
+  struct timespec t;
+  timespec_get(&t, TIME_UTC);
+  return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
 #else
- #define is_lua_ok(status_code) (!status_code)
+  return clock() * (1e6 / CLOCKS_PER_SEC);
 #endif
+}
 
-#ifdef LUA_OK
-  #define lua_is_bad() (!LUA_OK)
+static void trace_write_string(FILE * f, const char * str) {
+  fputc('"', f);
+  for (; *str; str++) {
+    unsigned char c = *str;
+    if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+    else if (c < 0x20) fprintf(f, "\\u%04x", c);
+    else fputc(c, f);
+  }
+  fputc('"', f);
+}
+
+static void trace_write(void) {
+  int is_stderr = !strcmp(glua_trace.output, "1") || !strcmp(glua_trace.output, "stderr");
+  FILE * f = is_stderr ? stderr : fopen(glua_trace.output, "w");
+  if (!f) return;
+
+  double now = trace_now();
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  for (int i = 0; i < glua_trace.count; i++) {
+    trace_event_t * event = glua_trace.events + i;
+    double duration = event->duration < 0 ? now - event->start : event->duration; // still open at exit
+    fprintf(f, "  {\"name\": ");
+    trace_write_string(f, event->name);
+    fprintf(f, ", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": 1, \"args\": {\"depth\": %d}}%s\n",
+      event->category, event->start, duration, event->depth, i + 1 < glua_trace.count ? "," : "");
+    free(event->name);
+  }
+  fprintf(f, "]}\n");
+  if (!is_stderr) fclose(f);
+  free(glua_trace.events);
+  glua_trace.count = 0;
+}
+
+static int trace_is_enabled(void) {
+  if (glua_trace.enabled < 0) {
+    glua_trace.output = getenv("GLUA_TRACE");
+    glua_trace.enabled = glua_trace.output && glua_trace.output[0] != '\0';
+    if (glua_trace.enabled) atexit(trace_write);
+  }
+  return glua_trace.enabled;
+}
+
+static int trace_begin(const char * name, const char * category) {
+  if (!trace_is_enabled()) return -1;
+  if (glua_trace.count >= glua_trace.capacity) {
+    int capacity = glua_trace.capacity ? 2 * glua_trace.capacity : 64;
+    trace_event_t * events = (trace_event_t *) realloc(glua_trace.events, capacity * sizeof(*events));
+    if (!events) return -1;
+    glua_trace.events = events;
+    glua_trace.capacity = capacity;
+  }
+  trace_event_t * event = glua_trace.events + glua_trace.count;
+  event->name = (char *) malloc(strlen(name) + 1);
+  if (!event->name) return -1;
+  strcpy(event->name, name);
+  event->category = category;
+  event->depth = glua_trace.depth;
+  event->duration = -1;
+  event->start = trace_now();
+  glua_trace.depth += 1;
+  return glua_trace.count++;
+}
+
+int glua_trace_begin(const char * name) {
+  return trace_begin(name, "startup");
+}
+
+void glua_trace_end(int event) {
+  if (event < 0) return;
+  glua_trace.events[event].duration = trace_now() - glua_trace.events[event].start;
+  glua_trace.depth -= 1;
+}
+
+// Replacement of the require function when tracing: the original one is the
+// upvalue
+static int trace_require(lua_State *L) {
+  int event = trace_begin(luaL_checkstring(L, 1), "require");
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_insert(L, 1);
+  int status = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+  glua_trace_end(event);
+  if (!is_lua_ok(status)) return lua_error(L);
+  return lua_gettop(L);
+}
+
+static void trace_install_require(lua_State *L) {
+  if (!trace_is_enabled()) return;
+  lua_getglobal(L, "require");
+  if (lua_isfunction(L, -1)) {
+    lua_pushcclosure(L, trace_require, 1);
+    lua_setglobal(L, "require");
+  } else {
+    lua_pop(L, 1);
+  }
+}
+
+// --------------------------------------------------------------------------------
+
+// Standard libraries that can be selected by the packed scripts, or loaded at
+// first access. The position in the list is the bit of the selection mask, so
+// new entries must be added at end.
+static const luaL_Reg glua_libraries[] = {
+  {LUA_COLIBNAME, luaopen_coroutine},
+  {LUA_TABLIBNAME, luaopen_table},
+  {LUA_IOLIBNAME, luaopen_io},
+  {LUA_OSLIBNAME, luaopen_os},
+  {LUA_STRLIBNAME, luaopen_string},
+  {LUA_MATHLIBNAME, luaopen_math},
+#ifdef LUA_UTF8LIBNAME
+  {LUA_UTF8LIBNAME, luaopen_utf8},
+#else
+  {"utf8", NULL},
+#endif
+  {LUA_DBLIBNAME, luaopen_debug},
+#if LUA_VERSION_NUM == 502
+  {LUA_BITLIBNAME, luaopen_bit32},
 #else
-  #define lua_is_bad() (is_lua_ok(0) ? 1 : 0)
+  {"bit32", NULL},
 #endif
+  {NULL, NULL}
+};
 
-void luaL_openlibs (lua_State *L); // Lua internal - not part of the lua API
+// The libraries are selected, with a bit for each glua_libraries entry; without
+// it, all the libraries are available
+#define GLUA_LIBRARIES_SELECTED (0x8000)
+
+// If not zero, the libraries are not opened at startup, but when they are
+// first accessed, as global or with require. The base, package and string
+// ones are always opened, since lua uses the latter for the string methods.
+#ifndef GLUA_LAZY_LIBS
+#define GLUA_LAZY_LIBS (0)
+#endif // GLUA_LAZY_LIBS
+
+unsigned int glua_library_selection = 0;
+
+int library_find(const char * name) {
+  for (int i = 0; glua_libraries[i].name; i++)
+    if (!strcmp(glua_libraries[i].name, name)) return i;
+  return -1;
+}
+
+int library_is_available(unsigned int selection, int index) {
+  if (index < 0 || !glua_libraries[index].func) return 0;
+  return !(selection & GLUA_LIBRARIES_SELECTED) || (selection & (1u << index));
+}
+
+// __index of the globals: open a library when it is first accessed. The
+// selection is the upvalue.
+static int library_global_index(lua_State *L) {
+  const char * name = lua_tostring(L, 2);
+  int index = name ? library_find(name) : -1;
+  if (!library_is_available((unsigned int) lua_tointeger(L, lua_upvalueindex(1)), index)) return 0;
+  luaL_requiref(L, name, glua_libraries[index].func, 1);
+  return 1;
+}
+
+// Open the libraries not yet loaded, and drop the globals metatable that
+// would load them
+static void library_open_all(lua_State *L) {
+  lua_pushglobaltable(L);
+  if (!lua_getmetatable(L, -1)) {
+    lua_pop(L, 1);
+    return;
+  }
+  lua_getfield(L, -1, "__index");
+  if (lua_tocfunction(L, -1) != library_global_index) {
+    lua_pop(L, 3);
+    return;
+  }
+  lua_getupvalue(L, -1, 1);
+  unsigned int selection = (unsigned int) lua_tointeger(L, -1);
+  lua_pop(L, 3);
+
+  lua_pushnil(L);
+  lua_setmetatable(L, -2);
+  for (int i = 0; glua_libraries[i].name; i++) {
+    if (!library_is_available(selection, i)) continue;
+    lua_getfield(L, -1, glua_libraries[i].name);
+    int missing = lua_isnil(L, -1);
+    lua_pop(L, 1);
+    if (missing) {
+      luaL_requiref(L, glua_libraries[i].name, glua_libraries[i].func, 1);
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+}
+
+// getmetatable and setmetatable, the original one is the upvalue. A script
+// that reaches the metatable of the globals, e.g. strict.lua, would replace
+// or change the one that loads the libraries: they are all opened before.
+static int library_metatable_access(lua_State *L) {
+  lua_pushglobaltable(L);
+  if (lua_rawequal(L, 1, -1)) library_open_all(L);
+  lua_pop(L, 1);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_insert(L, 1);
+  lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+  return lua_gettop(L);
+}
+
+static void open_libraries(lua_State *L, unsigned int selection) {
+  if (!GLUA_LAZY_LIBS && !(selection & GLUA_LIBRARIES_SELECTED)) {
+    luaL_openlibs(L);
+    return;
+  }
+
+  luaL_requiref(L, "_G", luaopen_base, 1);
+  luaL_requiref(L, LUA_LOADLIBNAME, luaopen_package, 1);
+  luaL_requiref(L, LUA_STRLIBNAME, luaopen_string, 1);
+  lua_pop(L, 3);
+
+  // The other ones are found by require in the preload table, or by the
+  // globals metatable
+  luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
+  for (int i = 0; glua_libraries[i].name; i++) {
+    if (!library_is_available(selection, i)) continue;
+    lua_pushcfunction(L, glua_libraries[i].func);
+    lua_setfield(L, -2, glua_libraries[i].name);
+  }
+  lua_pop(L, 1);
+
+  lua_pushglobaltable(L);
+  lua_createtable(L, 0, 1);
+  lua_pushinteger(L, selection);
+  lua_pushcclosure(L, library_global_index, 1);
+  lua_setfield(L, -2, "__index");
+  lua_setmetatable(L, -2);
+  lua_pop(L, 1);
+
+  lua_getglobal(L, "getmetatable");
+  lua_pushcclosure(L, library_metatable_access, 1);
+  lua_setglobal(L, "getmetatable");
+  lua_getglobal(L, "setmetatable");
+  lua_pushcclosure(L, library_metatable_access, 1);
+  lua_setglobal(L, "setmetatable");
+}
+
+// --------------------------------------------------------------------------------
 
 static int script_msghandler (lua_State *L) {
 
@@ -79,7 +349,317 @@ static void report_error(lua_State *L, const char * title){
   lua_pcall(L, 2, 1, 0);
 }
 
-int luamain_start(lua_State *L, char* script, int size, int argc, char **argv) {
+// --------------------------------------------------------------------------------
+
+// Pooled allocator. The small blocks, like most strings, tables and closures,
+// are served by a free list for each size class; the lists are refilled from
+// big arenas, with a bump pointer. Lua passes the size of the block being
+// freed, so the small blocks need no header. The bigger blocks are served by
+// the system allocator. The GLUA_ALLOC environment variable selects it
+// ("pool") or the standard one ("system"); the default is GLUA_POOL_ALLOC.
+
+#ifndef GLUA_POOL_ALLOC
+#define GLUA_POOL_ALLOC (0)
+#endif // GLUA_POOL_ALLOC
+
+// The blocks must be aligned as the malloc ones (max_align_t, LUAI_MAXALIGN),
+// e.g. 16 byte on x86-64 for the long double in the userdata
+typedef union {
+  long double d;
+  long long i;
+  void * p;
+  void (*f)(void);
+} pool_align_t;
+
+typedef struct { char c; pool_align_t u; } pool_align_probe_t;
+#define GLUA_POOL_ALIGN (offsetof(pool_align_probe_t, u))
+
+// The size classes are multiples of the granule, that must be a multiple of
+// the alignment, so every block is aligned
+#define GLUA_POOL_GRANULE (16)
+#define GLUA_POOL_CLASSES (16)   // blocks up to 256 byte are pooled
+#define GLUA_POOL_SMALL (GLUA_POOL_GRANULE * GLUA_POOL_CLASSES)
+
+typedef char pool_granule_is_aligned[GLUA_POOL_GRANULE % GLUA_POOL_ALIGN == 0 ? 1 : -1];
+
+#ifndef GLUA_POOL_ARENA_SIZE
+#define GLUA_POOL_ARENA_SIZE (65536)
+#endif // GLUA_POOL_ARENA_SIZE
+
+// The blocks of an arena start after this, at a multiple of the granule
+typedef struct pool_arena_s {
+  struct pool_arena_s * next;
+} pool_arena_t;
+
+#define GLUA_POOL_ARENA_HEADER \
+  ((sizeof(pool_arena_t) + GLUA_POOL_GRANULE - 1) / GLUA_POOL_GRANULE * GLUA_POOL_GRANULE)
+
+typedef struct {
+  void * free_list[GLUA_POOL_CLASSES];
+  char * bump;
+  char * bump_end;
+  pool_arena_t * arenas;
+} glua_pool_t;
+
+static void * pool_acquire(glua_pool_t * pool, size_t size) {
+  if (size > GLUA_POOL_SMALL) return malloc(size);
+
+  int size_class = (size - 1) / GLUA_POOL_GRANULE;
+  void * block = pool->free_list[size_class];
+  if (block) {
+    memcpy(&pool->free_list[size_class], block, sizeof(void *));
+    return block;
+  }
+
+  size = (size_class + 1) * GLUA_POOL_GRANULE;
+  if (pool->bump_end - pool->bump < (ptrdiff_t) size) {
+    pool_arena_t * arena = (pool_arena_t *) malloc(GLUA_POOL_ARENA_SIZE);
+    if (!arena) return NULL;
+    arena->next = pool->arenas;
+    pool->arenas = arena;
+    pool->bump = (char *) arena + GLUA_POOL_ARENA_HEADER;
+    pool->bump_end = (char *) arena + GLUA_POOL_ARENA_SIZE;
+  }
+  block = pool->bump;
+  pool->bump += size;
+  return block;
+}
+
+static void pool_release(glua_pool_t * pool, void * block, size_t size) {
+  if (size > GLUA_POOL_SMALL) {
+    free(block);
+    return;
+  }
+  int size_class = (size - 1) / GLUA_POOL_GRANULE;
+  memcpy(block, &pool->free_list[size_class], sizeof(void *));
+  pool->free_list[size_class] = block;
+}
+
+static void * pool_alloc(void * ud, void * ptr, size_t osize, size_t nsize) {
+  glua_pool_t * pool = (glua_pool_t *) ud;
+  if (!ptr) return nsize ? pool_acquire(pool, nsize) : NULL; // osize is the type of the new object
+
+  if (nsize == 0) {
+    pool_release(pool, ptr, osize);
+    return NULL;
+  }
+  if (osize > GLUA_POOL_SMALL && nsize > GLUA_POOL_SMALL) return realloc(ptr, nsize);
+  if (osize <= GLUA_POOL_SMALL && nsize <= GLUA_POOL_SMALL
+  && (osize - 1) / GLUA_POOL_GRANULE == (nsize - 1) / GLUA_POOL_GRANULE)
+    return ptr;
+
+  // Lua 5.2 and 5.3 assume that a shrink never fails: without a new block,
+  // the old one is kept, bigger than needed. If it came from malloc, it then
+  // goes in a free list and it is not freed by pool_drop, but this happens
+  // only when the memory is already exhausted.
+  void * block = pool_acquire(pool, nsize);
+  if (!block) return nsize < osize ? ptr : NULL;
+  memcpy(block, ptr, osize < nsize ? osize : nsize);
+  pool_release(pool, ptr, osize);
+  return block;
+}
+
+// The arenas are freed all at once, after lua_close
+static void pool_drop(glua_pool_t * pool) {
+  while (pool->arenas) {
+    pool_arena_t * next = pool->arenas->next;
+    free(pool->arenas);
+    pool->arenas = next;
+  }
+  free(pool);
+}
+
+static int pool_is_enabled(void) {
+  const char * value = getenv("GLUA_ALLOC");
+  if (value && !strcmp(value, "pool")) return 1;
+  if (value && !strcmp(value, "system")) return 0;
+  return GLUA_POOL_ALLOC;
+}
+
+// Same as the one of luaL_newstate
+static void * system_alloc(void * ud, void * ptr, size_t osize, size_t nsize) {
+  (void) ud;
+  (void) osize;
+  if (nsize == 0) {
+    free(ptr);
+    return NULL;
+  }
+  return realloc(ptr, nsize);
+}
+
+// --------------------------------------------------------------------------------
+
+// Memory accounting. The allocator of the states created by glua (the system
+// or the pooled one) is wrapped to track the memory in use, and to fail the
+// allocations beyond a limit: lua then raises a "not enough memory" error. The
+// limit is set by the GLUA_MEMORY_LIMIT environment variable, e.g. "64M", or
+// else by the memory_limit packing option.
+
+#define GLUA_MEMORY_CLASSES (10)  // up to 16, 32, ... 4096 byte, and more
+
+typedef struct {
+  lua_Alloc alloc;  // wrapped allocator
+  void * ud;
+  size_t current;
+  size_t peak;
+  size_t limit;     // 0 for none
+  unsigned long long allocations;
+  unsigned long long reallocations;
+  unsigned long long frees;
+  unsigned long long failures;
+  unsigned long long classes[GLUA_MEMORY_CLASSES];  // allocations by size
+} glua_memory_t;
+
+// Memory limit of the running payload, in byte
+static unsigned long long glua_payload_memory_limit = 0;
+
+static int memory_class(size_t size) {
+  int result = 0;
+  while (result < GLUA_MEMORY_CLASSES - 1 && size > ((size_t) 16 << result)) result += 1;
+  return result;
+}
+
+static void * memory_alloc(void * ud, void * ptr, size_t osize, size_t nsize) {
+  glua_memory_t * memory = (glua_memory_t *) ud;
+  size_t old = ptr ? osize : 0; // without a block, osize is the type of the new object
+
+  // Shrinking never fails. The sizes are not summed, a huge nsize would wrap.
+  size_t others = memory->current - old;
+  if (nsize > old && memory->limit > 0 && (others > memory->limit || nsize > memory->limit - others)) {
+    memory->failures += 1;
+    return NULL;
+  }
+  void * result = memory->alloc(memory->ud, ptr, osize, nsize);
+  if (!result && nsize > 0) {
+    memory->failures += 1;
+    return NULL;
+  }
+
+  memory->current = others + nsize;
+  if (memory->current > memory->peak) memory->peak = memory->current;
+  if (nsize == 0) {
+    if (ptr) memory->frees += 1;
+  } else if (ptr) {
+    memory->reallocations += 1;
+  } else {
+    memory->allocations += 1;
+    memory->classes[memory_class(nsize)] += 1;
+  }
+  return result;
+}
+
+static void memory_drop(glua_memory_t * memory) {
+  if (memory->alloc == pool_alloc) pool_drop((glua_pool_t *) memory->ud);
+  free(memory);
+}
+
+// Parse a size in byte, with an optional K, M or G suffix; 0 if invalid or
+// if it does not fit a size_t
+static size_t memory_parse_size(const char * value) {
+  char * end;
+  int shift = 0;
+  if (value[0] < '0' || value[0] > '9') return 0; // strtoull accepts a sign
+  errno = 0;
+  unsigned long long result = strtoull(value, &end, 10);
+  if (errno == ERANGE) return 0;
+  switch (*end) {
+    case 'k': case 'K': shift = 10; end += 1; break;
+    case 'm': case 'M': shift = 20; end += 1; break;
+    case 'g': case 'G': shift = 30; end += 1; break;
+  }
+  if (*end != '\0' || result > ((size_t) -1) >> shift) return 0;
+  return (size_t) result << shift;
+}
+
+static size_t memory_environment_limit(void) {
+  const char * value = getenv("GLUA_MEMORY_LIMIT");
+  if (!value) return 0;
+  size_t limit = memory_parse_size(value);
+  if (!limit && value[0] && strcmp(value, "0")) // 0 removes the limit of the payload
+    fprintf(stderr, "GLUA_MEMORY_LIMIT: invalid size %s, no limit is applied\n", value);
+  return limit;
+}
+
+static glua_memory_t * memory_of_state(lua_State *L) {
+  void * ud = NULL;
+  return lua_getallocf(L, &ud) == memory_alloc ? (glua_memory_t *) ud : NULL;
+}
+
+// Apply the limit of the payload, unless one is set by the environment
+static void memory_apply_payload_limit(lua_State *L) {
+  glua_memory_t * memory = memory_of_state(L);
+  if (memory && glua_payload_memory_limit > 0 && !getenv("GLUA_MEMORY_LIMIT"))
+    memory->limit = glua_payload_memory_limit;
+}
+
+// --------------------------------------------------------------------------------
+
+// Same as the ones set by luaL_newstate, that are not exported
+static int state_panic(lua_State *L) {
+  const char * msg = lua_tostring(L, -1);
+  fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", msg ? msg : "error object is not a string");
+  fflush(stderr);
+  return 0;
+}
+
+#if LUA_VERSION_NUM >= 504
+static void state_warn(void * ud, const char * message, int tocont) {
+  static int enabled = 0;
+  static int continued = 0;
+  if (!continued && !tocont && message[0] == '@') { // control message
+    if (!strcmp(message, "@off")) enabled = 0;
+    else if (!strcmp(message, "@on")) enabled = 1;
+    return;
+  }
+  if (enabled) {
+    if (!continued) fprintf(stderr, "Lua warning: ");
+    fprintf(stderr, "%s", message);
+    if (!tocont) fprintf(stderr, "\n");
+    fflush(stderr);
+  }
+  continued = tocont;
+}
+#endif // LUA_VERSION_NUM >= 504
+
+static lua_State * state_new(void) {
+  glua_memory_t * memory = (glua_memory_t *) calloc(1, sizeof(*memory));
+  if (!memory) return NULL;
+  memory->alloc = system_alloc;
+  memory->limit = memory_environment_limit();
+  if (pool_is_enabled()) {
+    memory->ud = calloc(1, sizeof(glua_pool_t));
+    if (!memory->ud) {
+      free(memory);
+      return NULL;
+    }
+    memory->alloc = pool_alloc;
+  }
+
+  lua_State *L = lua_newstate(memory_alloc, memory);
+  if (!L) {
+    memory_drop(memory);
+    return NULL;
+  }
+  lua_atpanic(L, state_panic);
+#if LUA_VERSION_NUM >= 504
+  lua_setwarnf(L, state_warn, NULL);
+#endif // LUA_VERSION_NUM >= 504
+  return L;
+}
+
+static void state_close(lua_State *L) {
+  void * ud = NULL;
+  lua_Alloc alloc = lua_getallocf(L, &ud);
+  lua_close(L);
+  if (alloc == memory_alloc) memory_drop((glua_memory_t *) ud);
+}
+
+// --------------------------------------------------------------------------------
+
+// Push the main chunk on the stack, returning a lua status code
+typedef int (*luamain_load_t)(lua_State *L, void * data);
+
+static int luamain_run(lua_State *L, luamain_load_t load, void * data, int argc, char **argv) {
   int status;
   int create_lua = 0;
   int base = 0;
@@ -87,7 +667,9 @@ int luamain_start(lua_State *L, char* script, int size, int argc, char **argv) {
   // create state as needed
   if (L == NULL) {
     create_lua = 1;
-    L = luaL_newstate();
+    int trace = glua_trace_begin("new_state");
+    L = state_new();
+    glua_trace_end(trace);
     if (L == NULL) return FAIL_ALLOC;
   }
 
@@ -97,8 +679,6 @@ int luamain_start(lua_State *L, char* script, int size, int argc, char **argv) {
     script_globalL = L;  // to be available to 'sigint_handler'
   }
 
-  luaopen_glua(L);
-
   // Prepare the stack with the error handler
   lua_pushcfunction(L, script_msghandler);
   base = lua_gettop(L);
@@ -120,9 +700,15 @@ int luamain_start(lua_State *L, char* script, int size, int argc, char **argv) {
   // Save the table in the global namespace
   lua_setglobal(L, "arg");
 
-  // Load the script in the stack
-  if (size < 0) size = strlen(script);
-  status = luaL_loadbuffer(L, script, size, "embedded");
+  // Load the script in the stack. The libraries are opened after it, since
+  // the payload can select them.
+  glua_library_selection = 0;
+  glua_payload_memory_limit = 0;
+  int trace = glua_trace_begin("load");
+  status = load(L, data);
+  glua_trace_end(trace);
+  luaopen_glua(L);
+  memory_apply_payload_limit(L);
   if (!is_lua_ok(status)) {
     report_error(L, "An error occurred during the script load.");
     status = FAIL_EXECUTION;
@@ -131,7 +717,11 @@ int luamain_start(lua_State *L, char* script, int size, int argc, char **argv) {
 
   // Run the script with the signal handler
   status = lua_is_bad();
+  trace = glua_trace_begin("run");
+  profile_script_start(L);
   status = lua_pcall(L, 0, LUA_MULTRET, base);
+  profile_stop(L);
+  glua_trace_end(trace);
   if (is_lua_ok(status)) {
     status = ALL_IS_RIGHT;
     goto luamain_end;
@@ -151,10 +741,205 @@ luamain_end:
   }
 
   if (base>0) lua_remove(L, base);  // remove lua message handler
-  if (create_lua) lua_close(L);
+  if (create_lua) {
+    trace = glua_trace_begin("close");
+    state_close(L);
+    glua_trace_end(trace);
+  }
   return status;
 }
 
+void payload_header_init(glua_payload_header_t * header, int flags) {
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, GLUA_PAYLOAD_MAGIC, sizeof(header->magic));
+  header->version = GLUA_PAYLOAD_VERSION;
+  header->flags = flags;
+  header->lua_major = LUA_VERSION_NUM / 100;
+  header->lua_minor = LUA_VERSION_NUM % 100;
+  header->integer_size = sizeof(lua_Integer);
+  header->number_size = sizeof(lua_Number);
+}
+
+// Check that the payload can be loaded by this lua, pushing an error message if not
+static int payload_header_check(lua_State *L, glua_payload_header_t * header) {
+  if (header->version != GLUA_PAYLOAD_VERSION || (header->flags & ~GLUA_PAYLOAD_KNOWN_FLAGS)) {
+    lua_pushfstring(L, "unsupported payload format %d (flags %d)", header->version, header->flags);
+    return lua_is_bad();
+  }
+  if (header->lua_major != LUA_VERSION_NUM / 100 || header->lua_minor != LUA_VERSION_NUM % 100
+  ||  header->integer_size != sizeof(lua_Integer) || header->number_size != sizeof(lua_Number)) {
+    lua_pushfstring(L, "payload generated for lua %d.%d (%d byte integer, %d byte number), this is lua %d.%d",
+      header->lua_major, header->lua_minor, header->integer_size, header->number_size,
+      LUA_VERSION_NUM / 100, LUA_VERSION_NUM % 100);
+    return lua_is_bad();
+  }
+  return 0;
+}
+
+static const char * script_read(lua_State *L, void * data, size_t * size) {
+  script_reader_t * reader = (script_reader_t *) data;
+  const char * chunk = reader->memory;
+
+  if (chunk) {
+    *size = reader->remaining;
+    reader->memory = NULL;
+  } else if (reader->pending) {
+    *size = reader->pending;
+    reader->pending = 0;
+    chunk = reader->buffer;
+  } else if (reader->file) {
+    *size = reader->remaining < sizeof(reader->buffer) ? reader->remaining : sizeof(reader->buffer);
+    *size = fread(reader->buffer, 1, *size, reader->file);
+    chunk = reader->buffer;
+  } else {
+    *size = 0;
+  }
+  reader->remaining = *size > 0 ? reader->remaining - *size : 0;
+
+  if (*size == 0) return NULL;
+  return chunk;
+}
+
+// Consume the payload header, if the script starts with one
+static int script_read_header(script_reader_t * reader, glua_payload_header_t * header) {
+  size_t size = sizeof(*header);
+  if (reader->remaining < size) return 0;
+
+  if (reader->memory) {
+    memcpy(header, reader->memory, size);
+  } else if (reader->file) {
+    reader->pending = fread(reader->buffer, 1, size, reader->file);
+    if (reader->pending < size) return 0;
+    memcpy(header, reader->buffer, size);
+  } else {
+    return 0;
+  }
+  if (memcmp(header->magic, GLUA_PAYLOAD_MAGIC, sizeof(header->magic))) return 0;
+
+  if (reader->memory) reader->memory += size;
+  reader->pending = 0;
+  reader->remaining -= size;
+  return 1;
+}
+
+const char * script_fetch(script_reader_t * reader, char * buffer, size_t size) {
+  const char * result = buffer;
+  if (size > reader->remaining) return NULL;
+  if (reader->memory) {
+    result = reader->memory;
+    reader->memory += size;
+  } else if (!reader->file || size != fread(buffer, 1, size, reader->file)) {
+    return NULL;
+  }
+  reader->remaining -= size;
+  return result;
+}
+
+// Decompress the payload one block at time
+typedef struct {
+  script_reader_t * source;
+  char * input;
+  char * output;
+  int error;
+} compressed_reader_t;
+
+static const char * compressed_read(lua_State *L, void * data, size_t * size) {
+  compressed_reader_t * reader = (compressed_reader_t *) data;
+  glua_block_header_t block;
+  *size = 0;
+  if (reader->source->remaining == 0) return NULL;
+
+  const char * chunk = script_fetch(reader->source, reader->input, sizeof(block));
+  if (!chunk) goto error;
+  memcpy(&block, chunk, sizeof(block));
+  if (block.raw_size > GLUA_COMPRESS_BLOCK_SIZE || block.packed_size > block.raw_size) goto error;
+
+  chunk = script_fetch(reader->source, reader->input, block.packed_size);
+  if (!chunk) goto error;
+  if (block.packed_size < block.raw_size) {
+    if ((int) block.raw_size != glua_lz_decompress(chunk, block.packed_size, reader->output, block.raw_size))
+      goto error;
+    chunk = reader->output;
+  }
+  *size = block.raw_size;
+  return chunk;
+
+error:
+  reader->error = 1;
+  return NULL;
+}
+
+static int load_compressed_script(lua_State *L, script_reader_t * source, const char * chunkname, const char * mode) {
+  compressed_reader_t reader = { .source = source };
+  reader.input = (char *) malloc(GLUA_COMPRESS_BLOCK_SIZE);
+  reader.output = (char *) malloc(GLUA_COMPRESS_BLOCK_SIZE);
+
+  int status = lua_is_bad();
+  if (!reader.input || !reader.output) {
+    lua_pushstring(L, "not enough memory to decompress the payload");
+  } else {
+    status = lua_load(L, compressed_read, &reader, chunkname, mode);
+    if (reader.error) {
+      if (is_lua_ok(status)) status = lua_is_bad();
+      lua_pop(L, 1);
+      lua_pushstring(L, "corrupted compressed payload");
+    }
+  }
+
+  free(reader.input);
+  free(reader.output);
+  return status;
+}
+
+int load_payload(lua_State *L, script_reader_t * reader, int flags, const char * chunkname) {
+  const char * mode = (flags & GLUA_PAYLOAD_BYTECODE) ? "b" : NULL;
+  if (flags & GLUA_PAYLOAD_COMPRESSED) return load_compressed_script(L, reader, chunkname, mode);
+  return lua_load(L, script_read, reader, chunkname, mode);
+}
+
+// --------------------------------------------------------------------------------
+
+// The GLUA_VERIFY environment variable selects when the embedded payload is
+// checked against its checksum: not set or "0" never, "lazy" each archive
+// entry when it is loaded, any other value the whole payload at startup.
+int verify_mode(void) {
+  static int mode = -1;
+  if (mode < 0) {
+    const char * value = getenv("GLUA_VERIFY");
+    if (!value || value[0] == '\0' || !strcmp(value, "0")) mode = GLUA_VERIFY_NONE;
+    else if (!strcmp(value, "lazy")) mode = GLUA_VERIFY_LAZY;
+    else mode = GLUA_VERIFY_STARTUP;
+  }
+  return mode;
+}
+
+// --------------------------------------------------------------------------------
+
+// --------------------------------------------------------------------------------
+
+static int load_script(lua_State *L, void * data) {
+  script_reader_t * reader = (script_reader_t *) data;
+  glua_payload_header_t header;
+
+  if (!script_read_header(reader, &header)) return load_payload(L, reader, 0, "embedded");
+
+  int status = payload_header_check(L, &header);
+  if (!is_lua_ok(status)) return status;
+  glua_library_selection = header.libraries;
+  glua_payload_memory_limit = (unsigned long long) header.memory_limit << 10;
+  if (!(header.flags & GLUA_PAYLOAD_ARCHIVE)) return load_payload(L, reader, header.flags, "embedded");
+
+  status = archive_open(L, &glua_archive, reader);
+  if (!is_lua_ok(status)) return status;
+  return archive_load(L, &glua_archive, glua_archive.entries + glua_archive.header.main_entry, "embedded");
+}
+
+int luamain_start(lua_State *L, char* script, int size, int argc, char **argv) {
+  script_reader_t reader = { .memory = script };
+  reader.remaining = size < 0 ? strlen(script) : size;
+  return luamain_run(L, load_script, &reader, argc, argv);
+}
+
 // --------------------------------------------------------------------------------
 
 // Size of the data for the INTERNAL ARRAY mechanism. It should be
@@ -165,81 +950,593 @@ luamain_end:
 
 BINJECT_STATIC_STRING("```replace_data```", BINJECT_ARRAY_SIZE, static_data);
 
-static char* self_binary_path = 0;
+char * self_binary_path = 0;
 
 int set_self_binary_path(const char* self_path){
   self_binary_path = (char*) self_path;
 }
 
 int binject_main_app_has_internal_script() {
-  unsigned int size = 0;
-  unsigned int offset = 0;
-  binject_get_static_script(static_data, &size, &offset);
+  binject_size_t size = 0;
+  binject_size_t offset = 0;
+  binject_get_static_script64(static_data, &size, &offset);
   if (size > 0 || offset > 0) return 1;
   return 0;
 }
 
+typedef struct {
+  script_reader_t reader;
+  char * map;
+  binject_size_t size;
+  binject_size_t offset;
+} tail_script_t;
+
+static void tail_script_release(tail_script_t * tail) {
+  if (tail->map) binject_unmap_tail_script(tail->map, tail->size, tail->offset);
+  if (tail->reader.file) fclose(tail->reader.file);
+  tail->map = NULL;
+  tail->reader.file = NULL;
+}
+
+static int load_tail_script(lua_State *L, void * data) {
+  tail_script_t * tail = (tail_script_t *) data;
+  int status = load_script(L, &tail->reader);
+  if (!tail->reader.retained) tail_script_release(tail); // the script is not needed after the load
+  return status;
+}
+
+// Report why the payload did not pass binject_verify_script, if it did not
+static const char * verify_error(int result) {
+  if (result == NO_ERROR) return NULL;
+  if (result == INVALID_DATA_ERROR) return "embedded payload is corrupted (checksum mismatch)";
+  if (result == INVALID_RESOURCE_ERROR) return "no checksum found, the executable may be truncated";
+  return "can not read the embedded payload to verify it";
+}
+
 int binject_main_app_internal_script_handle(lua_State *L, int argc, char **argv) {
-  unsigned int size;
-  unsigned int offset;
+  binject_size_t size;
+  binject_size_t offset;
+
+  if (verify_mode() == GLUA_VERIFY_STARTUP) {
+    int trace = glua_trace_begin("verify");
+    const char * error = verify_error(binject_verify_script(static_data, self_binary_path));
+    glua_trace_end(trace);
+    if (error) {
+      fprintf(stderr, "%s\n", error);
+      return FAIL_INIT;
+    }
+  }
 
   // Get information from static section
-  char * script = binject_get_static_script(static_data, &size, &offset);
+  char * script = binject_get_static_script64(static_data, &size, &offset);
 
   if (script) {
     // Script found in the static section
-    return luamain_start(L, script, size, argc, argv);
+    script_reader_t reader = { .memory = script, .remaining = size };
+    return luamain_run(L, load_script, &reader, argc, argv);
 
   } else {
-    // Script should be at end of the binary
-    unsigned int script_size = binject_get_tail_script(static_data, self_binary_path, 0, 0, offset);
-    char buf[script_size];
-    binject_get_tail_script(static_data, self_binary_path, buf, script_size, offset);
-    return luamain_start(L, buf, script_size, argc, argv);
+    // Script should be at end of the binary: map it or, if it is not
+    // possible, read it one chunk at time
+    tail_script_t tail = { .offset = offset };
+    int trace = glua_trace_begin("open_tail");
+    tail.map = binject_map_tail_script(static_data, self_binary_path, offset, &tail.size);
+    if (tail.map) tail.reader.memory = tail.map;
+    else tail.reader.file = binject_open_tail_script(static_data, self_binary_path, offset, &tail.size);
+    glua_trace_end(trace);
+    if (!tail.map && !tail.reader.file) {
+      fprintf(stderr, "Can not read the embedded script\n");
+      return FAIL_INIT;
+    }
+    tail.reader.remaining = tail.size;
+
+    int status = luamain_run(L, load_tail_script, &tail, argc, argv);
+    if (tail.reader.retained) archive_close(&glua_archive);
+    tail_script_release(&tail);
+    return status;
+  }
+
+  return NO_ERROR;
+}
+
+// Compress a block of at most GLUA_COMPRESS_BLOCK_SIZE byte, with its header.
+// It returns the size written in packed, that must hold the header and the
+// whole raw block, since a block is stored uncompressed if it does not shrink.
+static size_t compress_block(const char * data, size_t size, char * packed) {
+  glua_block_header_t block;
+  char * destination = packed + sizeof(block);
+  block.raw_size = size;
+  block.packed_size = glua_lz_compress(data, size, destination, size - 1);
+  if (block.packed_size == 0) {
+    block.packed_size = size;
+    memcpy(destination, data, size);
+  }
+  memcpy(packed, &block, sizeof(block));
+  return sizeof(block) + block.packed_size;
+}
+
+// Split the data in compressed blocks
+static int compress_payload(const char * data, size_t size, char ** result, size_t * result_size) {
+  size_t blocks = size / GLUA_COMPRESS_BLOCK_SIZE + 1;
+  char * packed = (char *) malloc(size + blocks * sizeof(glua_block_header_t));
+  if (!packed) return GENERIC_ERROR;
+
+  size_t position = 0;
+  for (size_t done = 0; done < size; ) {
+    size_t raw_size = size - done < GLUA_COMPRESS_BLOCK_SIZE ? size - done : GLUA_COMPRESS_BLOCK_SIZE;
+    position += compress_block(data + done, raw_size, packed + position);
+    done += raw_size;
   }
 
+  *result = packed;
+  *result_size = position;
   return NO_ERROR;
 }
 
-static int binject_main_app_internal_script_inject(const char * scr_path, const char * outpath){
+// Stage of the injection pipeline that compresses the data streaming through
+// it, a block at time
+typedef struct {
+  char raw[GLUA_COMPRESS_BLOCK_SIZE];
+  size_t size;
+  char packed[sizeof(glua_block_header_t) + GLUA_COMPRESS_BLOCK_SIZE];
+} compress_stage_t;
+
+static int compress_stage(binject_stage_t * stage, const char * data, size_t size) {
+  compress_stage_t * c = (compress_stage_t *) binject_stage_ud(stage);
+  int result = NO_ERROR;
+  if (!data && c->size > 0) {
+    result = binject_stage_emit(stage, c->packed, compress_block(c->raw, c->size, c->packed));
+    c->size = 0;
+  }
+  while (NO_ERROR == result && size > 0) {
+    size_t part = GLUA_COMPRESS_BLOCK_SIZE - c->size;
+    if (part > size) part = size;
+    memcpy(c->raw + c->size, data, part);
+    c->size += part;
+    data += part;
+    size -= part;
+    if (c->size < GLUA_COMPRESS_BLOCK_SIZE) break;
+    result = binject_stage_emit(stage, c->packed, compress_block(c->raw, c->size, c->packed));
+    c->size = 0;
+  }
+  return result;
+}
+
+// Producer of the payload data: it writes them to the writer, adding the
+// stages they need
+typedef int (*payload_source_t)(binject_writer_t * writer, void * ud);
+
+static int buffer_source(binject_writer_t * writer, void * ud){
+  encoded_script_t * script = (encoded_script_t *) ud;
+  return binject_writer_write(writer, script->data, script->size);
+}
+
+// Inject the payload with the writer: the header, if flags require it, then
+// the data
+static int payload_write(binject_writer_t * writer, glua_pack_options_t * options,
+    int flags, payload_source_t source, void * ud){
+  glua_payload_header_t header;
+
+  if (!writer) return ACCESS_ERROR;
+  if (flags || options->libraries || options->memory_limit) {
+    payload_header_init(&header, flags);
+    header.libraries = options->libraries;
+    header.memory_limit = options->memory_limit;
+    binject_writer_write(writer, (const char *) &header, sizeof(header));
+  }
+  int result = source(writer, ud);
+  int commit = binject_writer_commit(writer);
+  return NO_ERROR != result ? result : commit;
+}
+
+// Generate the output binary with the payload
+static int binject_main_app_internal_payload_inject(const char * outpath, glua_pack_options_t * options,
+    int flags, payload_source_t source, void * ud){
+  int result = NO_ERROR;
+
+  // Copy the binary, unless the one generated before can be updated
+  binject_writer_t * writer = options->update ? binject_writer_open_update(static_data, outpath) : NULL;
+  if (!writer) {
+    int trace = glua_trace_begin("duplicate");
+    result = binject_duplicate_binary(static_data, self_binary_path, outpath);
+    glua_trace_end(trace);
+    if (NO_ERROR != result) return result;
+    writer = binject_writer_open(static_data, outpath);
+  }
+
+  // Inject the payload and update static info into the binary
+  int trace = glua_trace_begin("inject");
+  result = payload_write(writer, options, flags, source, ud);
+  glua_trace_end(trace);
+  if (NO_ERROR != result) return result;
+
+  if (options->section) result = binject_tail_to_section(static_data, outpath);
+  return result;
+}
+
+int read_script(const char * scr_path, char ** data, size_t * size){
   int result = ACCESS_ERROR;
-  errno = 0;
+  *data = NULL;
 
   // Open the scipt
   FILE * scr = fopen(scr_path, "rb");
   if (!scr) goto end;
 
-  // Get the original binary size
-  if (fseek(scr, 0, SEEK_END)) goto end;
-  int siz = ftell(scr);
-  if (siz < 0) goto end;
-  if (fseek(scr, 0, SEEK_SET)) goto end;
+  // Get the script size
+  if (glua_fseek(scr, 0, SEEK_END)) goto end;
+  long long siz = glua_ftell(scr);
+  if (siz < 0 || (unsigned long long) siz >= (size_t) -1) goto end;
+  if (glua_fseek(scr, 0, SEEK_SET)) goto end;
 
-  { // Scope block to avoid goto and variable length issue
-    char buf[siz];
+  *data = (char *) malloc(siz > 0 ? siz : 1);
+  if (!*data) goto end;
+  *size = fread(*data, 1, siz, scr);
+  if (*size != (size_t) siz) goto end;
+  result = NO_ERROR;
 
-    // Copy the binary
-    result = binject_duplicate_binary(static_data, self_binary_path, outpath);
-    if (NO_ERROR != result) goto end;
+end:
+  if (scr) fclose(scr);
+  if (NO_ERROR != result) {
+    free(*data);
+    *data = NULL;
+  }
+  return result;
+}
+
+int dump_write(lua_State *L, const void * p, size_t size, void * ud){
+  dump_buffer_t * dump = (dump_buffer_t *) ud;
+  if (dump->size + size > dump->capacity) {
+    size_t capacity = 2 * (dump->size + size);
+    char * data = (char *) realloc(dump->data, capacity);
+    if (!data) return 1;
+    dump->data = data;
+    dump->capacity = capacity;
+  }
+  memcpy(dump->data + dump->size, p, size);
+  dump->size += size;
+  return 0;
+}
 
-    // Read the script for the injection
-    if (0> fread(buf, 1, siz, scr)) goto end;
+int encode_script(lua_State *L, const char * path, glua_pack_options_t * options, encoded_script_t * script){
+  memset(script, 0, sizeof(*script));
 
-    // Inject the script and update static info into the binary
-    result = binject_step(static_data, outpath, buf, siz);
-    if (NO_ERROR != result) goto end;
+  if (!options->compile) {
+    if (NO_ERROR != read_script(path, &script->data, &script->size)) {
+      lua_pushfstring(L, "can not read %s: %s", path, strerror(errno));
+      return ACCESS_ERROR;
+    }
+  } else {
+    if (!is_lua_ok(luaL_loadfile(L, path))) return GENERIC_ERROR;
+    dump_buffer_t dump = { 0 };
+    int failed = glua_dump(L, dump_write, &dump, options->strip);
+    lua_pop(L, 1);
+    if (failed) {
+      free(dump.data);
+      lua_pushfstring(L, "can not compile %s", path);
+      return GENERIC_ERROR;
+    }
+    script->data = dump.data;
+    script->size = dump.size;
+    script->flags = GLUA_PAYLOAD_BYTECODE;
   }
 
-end:
-  if (0 != errno)
-    fprintf(stderr, "Error %d: %s\n", errno, strerror(errno));
-  if (scr) fclose(scr);
+  if (options->compress) {
+    char * packed;
+    if (NO_ERROR != compress_payload(script->data, script->size, &packed, &script->size)) {
+      free(script->data);
+      lua_pushfstring(L, "can not compress %s", path);
+      return GENERIC_ERROR;
+    }
+    free(script->data);
+    script->data = packed;
+    script->flags |= GLUA_PAYLOAD_COMPRESSED;
+  }
+  return NO_ERROR;
+}
+
+// Script streamed to the output, read from its file or dumped by lua, so
+// memory use does not grow with its size
+typedef struct {
+  lua_State * L;  // with the compiled script on top, if it is not read from file
+  FILE * file;
+  int strip;
+  compress_stage_t * compress; // NULL to not compress
+} stream_source_t;
+
+static int dump_to_writer(lua_State *L, const void * p, size_t size, void * ud){
+  return NO_ERROR != binject_writer_write((binject_writer_t *) ud, (const char *) p, size);
+}
+
+static int stream_source(binject_writer_t * writer, void * ud){
+  stream_source_t * stream = (stream_source_t *) ud;
+  if (stream->compress && !binject_writer_add_stage(writer, compress_stage, stream->compress))
+    return GENERIC_ERROR;
+
+  if (!stream->file)
+    return glua_dump(stream->L, dump_to_writer, writer, stream->strip) ? GENERIC_ERROR : NO_ERROR;
+
+  char buffer[GLUA_LOAD_CHUNK_SIZE];
+  size_t size;
+  int result = NO_ERROR;
+  while (NO_ERROR == result && 0 < (size = fread(buffer, 1, sizeof(buffer), stream->file)))
+    result = binject_writer_write(writer, buffer, size);
+  if (NO_ERROR == result && ferror(stream->file)) result = ACCESS_ERROR;
   return result;
 }
 
 // --------------------------------------------------------------------------------
 
+static void glua_pack_read_options(lua_State* L, int idx, glua_pack_options_t * options){
+  memset(options, 0, sizeof(*options));
+  if (lua_isnoneornil(L, idx)) return;
+  luaL_checktype(L, idx, LUA_TTABLE);
+
+  lua_getfield(L, idx, "section");
+  options->section = lua_toboolean(L, -1);
+  lua_getfield(L, idx, "strip");
+  options->strip = lua_toboolean(L, -1);
+#if LUA_VERSION_NUM < 503
+  if (options->strip) luaL_error(L, "the strip option needs lua 5.3 or later");
+#endif
+  lua_getfield(L, idx, "compile");
+  options->compile = options->strip || lua_toboolean(L, -1);
+  lua_getfield(L, idx, "compress");
+  options->compress = lua_toboolean(L, -1);
+  lua_getfield(L, idx, "update");
+  options->update = lua_toboolean(L, -1);
+  lua_pop(L, 5);
+
+  lua_getfield(L, idx, "memory_limit");
+  if (!lua_isnil(L, -1)) {
+    lua_Number limit = luaL_checknumber(L, -1);
+    if (limit < 1 || limit / 1024 >= 4294967295.0) luaL_error(L, "invalid memory_limit");
+    options->memory_limit = (unsigned int) ((limit + 1023) / 1024);
+  }
+  lua_pop(L, 1);
+
+  lua_getfield(L, idx, "libs");
+  if (!lua_isnil(L, -1)) {
+    luaL_checktype(L, -1, LUA_TTABLE);
+    options->libraries = GLUA_LIBRARIES_SELECTED;
+    for (int i = 1; lua_rawgeti(L, -1, i), !lua_isnil(L, -1); i++) {
+      const char * name = lua_tostring(L, -1);
+      int index = name ? library_find(name) : -1;
+      if (index < 0) luaL_error(L, "unknown standard library '%s'", name ? name : luaL_typename(L, -1));
+      options->libraries |= 1u << index;
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+}
+
+// --------------------------------------------------------------------------------
+// Batch packing: the runtime is read once, and the outputs are written by a
+// pool of threads. The scripts are encoded before, by the calling thread,
+// since the lua state can not be shared.
+
+#if !defined(GLUA_PACK_PARALLEL) && defined(_POSIX_THREADS) && _POSIX_THREADS > 0
+#define GLUA_PACK_PARALLEL 1
+#endif
+
+#if GLUA_PACK_PARALLEL
+#include <pthread.h>
+#endif
+
+typedef struct {
+  const char * output;  // owned by the job table, that is on the stack
+  glua_pack_options_t options;
+  encoded_script_t script;
+  int encoded;          // the job is skipped if the encoding fails
+  int result;
+} pack_job_t;
+
+typedef struct {
+  binject_image_t * image;
+  pack_job_t * jobs;
+  int count;
+  int next;             // first job not taken by a worker
+#if GLUA_PACK_PARALLEL
+  pthread_mutex_t lock;
+#endif
+} pack_batch_t;
+
+static void * pack_worker(void * ud){
+  pack_batch_t * batch = (pack_batch_t *) ud;
+  while (1) {
+#if GLUA_PACK_PARALLEL
+    pthread_mutex_lock(&batch->lock);
+#endif
+    int i = batch->next++;
+#if GLUA_PACK_PARALLEL
+    pthread_mutex_unlock(&batch->lock);
+#endif
+    if (i >= batch->count) break;
+
+    pack_job_t * job = batch->jobs + i;
+    if (!job->encoded) continue;
+    binject_writer_t * writer = job->options.update ? binject_writer_open_update(static_data, job->output) : NULL;
+    job->result = NO_ERROR;
+    if (!writer) {
+      job->result = binject_image_write(batch->image, job->output);
+      if (NO_ERROR == job->result) writer = binject_writer_open(static_data, job->output);
+    }
+    if (NO_ERROR == job->result)
+      job->result = payload_write(writer, &job->options, job->script.flags, buffer_source, &job->script);
+    if (NO_ERROR == job->result && job->options.section)
+      job->result = binject_tail_to_section(static_data, job->output);
+    free(job->script.data);
+    job->script.data = NULL;
+  }
+  return NULL;
+}
+
+static int pack_thread_count(lua_State* L, int options_idx, int jobs){
+  long count = 0;
+  if (!lua_isnoneornil(L, options_idx)) {
+    lua_getfield(L, options_idx, "threads");
+    count = (long) luaL_optinteger(L, -1, 0);
+    lua_pop(L, 1);
+  }
+  const char * env = getenv("GLUA_PACK_THREADS");
+  if (count <= 0 && env) count = strtol(env, NULL, 10);
+#if defined(_SC_NPROCESSORS_ONLN)
+  if (count <= 0) count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if (count > jobs) count = jobs;
+  return count > 0 ? (int) count : 1;
+}
+
+// Run the workers, the calling thread is one of them
+static void pack_run(pack_batch_t * batch, int threads){
+#if GLUA_PACK_PARALLEL
+  pthread_t * pool = (pthread_t *) malloc(threads * sizeof(*pool));
+  int started = 0;
+  pthread_mutex_init(&batch->lock, NULL);
+  if (pool)
+    while (started < threads - 1 && 0 == pthread_create(pool + started, NULL, pack_worker, batch))
+      started += 1;
+  pack_worker(batch);
+  for (int i = 0; i < started; i++) pthread_join(pool[i], NULL);
+  pthread_mutex_destroy(&batch->lock);
+  free(pool);
+#else
+  (void) threads;
+  pack_worker(batch);
+#endif
+}
+
+// glua_pack(jobs[, options]) with jobs like { {script, output[, options]}, ... }.
+// The options of a job replace the common ones. It returns a table with true or
+// an error message for each job.
+static int glua_pack_batch(lua_State* L){
+  luaL_checktype(L, 1, LUA_TTABLE);
+  glua_pack_options_t common;
+  glua_pack_read_options(L, 2, &common);
+  int count = (int) luaL_len(L, 1);
+  lua_settop(L, 2);
+
+  // The jobs are collected by lua, if an option is not valid
+  pack_batch_t batch = { 0 };
+  batch.count = count;
+  batch.jobs = (pack_job_t *) lua_newuserdata(L, (count > 0 ? count : 1) * sizeof(*batch.jobs));
+  memset(batch.jobs, 0, (count > 0 ? count : 1) * sizeof(*batch.jobs));
+  for (int i = 0; i < count; i++) {
+    lua_rawgeti(L, 1, i + 1);
+    if (lua_istable(L, -1)) lua_rawgeti(L, -1, 3);
+    if (lua_istable(L, -1)) glua_pack_read_options(L, lua_gettop(L), &batch.jobs[i].options);
+    else batch.jobs[i].options = common;
+    lua_settop(L, 3);
+  }
+
+  // Encode each script. The errors are stored in the results.
+  lua_createtable(L, count, 0);
+  int results_idx = lua_gettop(L);
+  for (int i = 0; i < count; i++) {
+    pack_job_t * job = batch.jobs + i;
+    lua_rawgeti(L, 1, i + 1);
+    int job_idx = lua_gettop(L);
+    if (!lua_istable(L, job_idx)) {
+      lua_pushstring(L, "a job must be a table like {script, output}");
+      goto next;
+    }
+    lua_rawgeti(L, job_idx, 1);
+    lua_rawgeti(L, job_idx, 2);
+    lua_rawgeti(L, job_idx, 3);
+    const char * input = lua_tostring(L, -3);
+    job->output = lua_type(L, -2) == LUA_TSTRING ? lua_tostring(L, -2) : NULL;
+    if (!input || !job->output || *input == '\0' || *job->output == '\0') {
+      lua_pushstring(L, "input or output file not provided");
+      goto next;
+    }
+
+    int options_idx = lua_istable(L, -1) ? lua_gettop(L) : 2;
+    int is_archive = archive_tables(L, options_idx);
+    if (NO_ERROR != encode_script(L, input, &job->options, &job->script)) goto next;
+    if (is_archive) {
+      encoded_script_t archive;
+      int result = build_archive(L, &job->script, &job->options, &archive);
+      free(job->script.data);
+      job->script = archive;
+      if (NO_ERROR != result) goto next;
+    }
+    job->encoded = 1;
+    lua_pushboolean(L, 1);
+
+  next:
+    lua_rawseti(L, results_idx, i + 1);
+    lua_settop(L, results_idx);
+  }
+
+  // Write the outputs
+  int trace = glua_trace_begin("duplicate");
+  batch.image = self_binary_path ? binject_image_open(static_data, self_binary_path) : NULL;
+  glua_trace_end(trace);
+  if (batch.image) {
+    trace = glua_trace_begin("inject");
+    pack_run(&batch, pack_thread_count(L, 2, count));
+    glua_trace_end(trace);
+    binject_image_close(batch.image);
+  }
+
+  for (int i = 0; i < count; i++) {
+    pack_job_t * job = batch.jobs + i;
+    if (!job->encoded) continue;
+    free(job->script.data);
+    if (!batch.image) lua_pushstring(L, "can not read the self binary");
+    else if (NO_ERROR != job->result) lua_pushstring(L, "can not generate the output file");
+    else continue;
+    lua_rawseti(L, results_idx, i + 1);
+  }
+  return 1;
+}
+
+// --------------------------------------------------------------------------------
+
+// Pack a single script, streaming it to the output. When it must be compiled,
+// it is done first, so the errors are reported before the output is generated.
+static int glua_pack_stream(lua_State* L, const char * inpath, const char * outpath, glua_pack_options_t * options){
+  stream_source_t stream = { L, NULL, options->strip, NULL };
+  int flags = 0;
+  int result = NO_ERROR;
+
+  if (options->compile) {
+    if (!is_lua_ok(luaL_loadfile(L, inpath))) {
+      lua_pushnil(L);
+      lua_insert(L, -2);
+      return 2;
+    }
+    flags |= GLUA_PAYLOAD_BYTECODE;
+  } else {
+    stream.file = fopen(inpath, "rb");
+    if (!stream.file) {
+      lua_pushnil(L);
+      lua_pushfstring(L, "can not read %s: %s", inpath, strerror(errno));
+      return 2;
+    }
+  }
+  if (options->compress) {
+    flags |= GLUA_PAYLOAD_COMPRESSED;
+    stream.compress = (compress_stage_t *) malloc(sizeof(*stream.compress));
+    if (stream.compress) stream.compress->size = 0;
+    else result = GENERIC_ERROR;
+  }
+
+  if (NO_ERROR == result)
+    result = binject_main_app_internal_payload_inject(outpath, options, flags, stream_source, &stream);
+  free(stream.compress);
+  if (stream.file) fclose(stream.file);
+  else lua_pop(L, 1);
+  if (result) {
+    lua_pushnil(L);
+    lua_pushstring(L, "can not read input file or generate output one");
+    return 2;
+  }
+  return 0;
+}
+
 static int glua_pack_call(lua_State* L){
+  if (lua_istable(L, 1)) return glua_pack_batch(L);
   if (!self_binary_path){
     lua_pushnil(L);
     lua_pushstring(L, "can not retrieve the self binary path");
@@ -252,7 +1549,29 @@ static int glua_pack_call(lua_State* L){
     lua_pushstring(L, "input or output file not provided");
     return 2;
   }
-  const int result = binject_main_app_internal_script_inject(inpath, outpath);
+  glua_pack_options_t options;
+  glua_pack_read_options(L, 3, &options);
+
+  lua_settop(L, 3);
+  if (!archive_tables(L, 3)) return glua_pack_stream(L, inpath, outpath, &options);
+
+  encoded_script_t script;
+  if (NO_ERROR != encode_script(L, inpath, &options, &script)) {
+    lua_pushnil(L);
+    lua_insert(L, -2);
+    return 2;
+  }
+  encoded_script_t archive;
+  int result = build_archive(L, &script, &options, &archive);
+  free(script.data);
+  if (NO_ERROR != result) {
+    lua_pushnil(L);
+    lua_insert(L, -2);
+    return 2;
+  }
+
+  result = binject_main_app_internal_payload_inject(outpath, &options, archive.flags, buffer_source, &archive);
+  free(archive.data);
   if (result) {
     lua_pushnil(L);
     lua_pushstring(L, "can not read input file or generate output one");
@@ -268,17 +1587,114 @@ int luaopen_glua_pack(lua_State* L){
   return 1;
 }
 
+// glua.verify([name]) checks the whole embedded payload or, with a name, an
+// embedded module or asset against its checksum. It returns true or nil plus a message.
+static int glua_verify_call(lua_State* L){
+  size_t size;
+  const char * name = luaL_optlstring(L, 1, NULL, &size);
+  const char * error = NULL;
+  if (!name) {
+    error = verify_error(binject_verify_script(static_data, self_binary_path));
+  } else {
+    glua_archive_entry_t * entry = archive_find(&glua_archive, name, size, 0);
+    if (!entry) entry = archive_find(&glua_archive, name, size, GLUA_PAYLOAD_ASSET);
+    if (!entry) error = "no embedded module or asset with this name";
+    else if (!archive_entry_is_intact(&glua_archive, entry)) error = "embedded data is corrupted (checksum mismatch)";
+  }
+  if (error) {
+    lua_pushnil(L);
+    lua_pushstring(L, error);
+    return 2;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+// glua.memstats() returns a table with the memory statistics of the state, or
+// nil plus a message if it was not created by glua
+static int glua_memstats_call(lua_State* L){
+  glua_memory_t * memory = memory_of_state(L);
+  if (!memory) {
+    lua_pushnil(L);
+    lua_pushstring(L, "memory accounting not available in this state");
+    return 2;
+  }
+  lua_createtable(L, 0, 9);
+  lua_pushinteger(L, (lua_Integer) memory->current); lua_setfield(L, -2, "current");
+  lua_pushinteger(L, (lua_Integer) memory->peak); lua_setfield(L, -2, "peak");
+  lua_pushinteger(L, (lua_Integer) memory->limit); lua_setfield(L, -2, "limit");
+  lua_pushinteger(L, (lua_Integer) memory->allocations); lua_setfield(L, -2, "allocations");
+  lua_pushinteger(L, (lua_Integer) memory->reallocations); lua_setfield(L, -2, "reallocations");
+  lua_pushinteger(L, (lua_Integer) memory->frees); lua_setfield(L, -2, "frees");
+  lua_pushinteger(L, (lua_Integer) memory->failures); lua_setfield(L, -2, "failures");
+  lua_pushstring(L, memory->alloc == pool_alloc ? "pool" : "system"); lua_setfield(L, -2, "allocator");
+
+  // Allocations by size: the key is the maximum size of the class
+  lua_createtable(L, 0, GLUA_MEMORY_CLASSES);
+  for (int i = 0; i < GLUA_MEMORY_CLASSES; i++) {
+    if (i < GLUA_MEMORY_CLASSES - 1) lua_pushinteger(L, 16 << i);
+    else lua_pushliteral(L, "larger");
+    lua_pushinteger(L, (lua_Integer) memory->classes[i]);
+    lua_settable(L, -3);
+  }
+  lua_setfield(L, -2, "classes");
+  return 1;
+}
+
+int luaopen_glua_lib(lua_State* L){
+  lua_newtable(L);
+  lua_pushcfunction(L, glua_verify_call); lua_setfield(L, -2, "verify");
+  lua_pushcfunction(L, glua_memstats_call); lua_setfield(L, -2, "memstats");
+  luaopen_glua_profile(L); lua_setfield(L, -2, "profile");
+  return 1;
+}
+
 int luaopen_whereami(lua_State* L){
   lua_pushstring(L, self_binary_path);
   return 1;
 }
 
+// --------------------------------------------------------------------------------
+
+// Helpers of the wrappers of the embedded filesystem and of the bytecode cache
+
+#if GLUA_VFS || GLUA_CACHE
+
+int call_original(lua_State *L) {
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_insert(L, 1);
+  lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+  return lua_gettop(L);
+}
+
+void wrap_function(lua_State *L, const char * name, lua_CFunction wrapper) {
+  lua_getfield(L, -1, name);
+  lua_pushcclosure(L, wrapper, 1);
+  lua_setfield(L, -2, name);
+}
+
+int loadfile_result(lua_State *L, int status, int env_index) {
+  if (!is_lua_ok(status)) {
+    lua_pushnil(L);
+    lua_insert(L, -2);
+    return 2;
+  }
+  if (!lua_isnone(L, env_index)) {
+    lua_pushvalue(L, env_index);
+    if (!lua_setupvalue(L, -2, 1)) lua_pop(L, 1);
+  }
+  return 1;
+}
+
+#endif // GLUA_VFS || GLUA_CACHE
+
 #ifdef PRELOAD_EXTRA
 int PRELOAD_EXTRA(lua_State* L);
 #endif
 
 int luaopen_glua(lua_State* L){
-  luaL_openlibs(L);
+  int trace = glua_trace_begin("openlibs");
+  open_libraries(L, glua_library_selection);
 #ifdef PRELOAD_EXTRA
   PRELOAD_EXTRA(L);
 #endif
@@ -287,8 +1703,16 @@ int luaopen_glua(lua_State* L){
 
   lua_pushcfunction(L, luaopen_whereami); lua_setfield(L, -2, "whereami");
   lua_pushcfunction(L, luaopen_glua_pack); lua_setfield(L, -2, "glua_pack");
+  lua_pushcfunction(L, luaopen_glua_lib); lua_setfield(L, -2, "glua");
+  lua_pushcfunction(L, luaopen_glua_asset); lua_setfield(L, -2, "glua.asset");
 
   lua_pop(L, 1);
+
+  cache_install(L);
+  archive_install_searcher(L);
+  vfs_install(L);
+  trace_install_require(L);
+  glua_trace_end(trace);
   return 0;
 }
 
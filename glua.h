@@ -6,3 +6,8 @@ int binject_main_app_has_internal_script();
 int binject_main_app_internal_script_handle(lua_State *L, int argc, char **argv);
 int luaopen_glua(lua_State* L);
 
+// Startup tracing, enabled by the GLUA_TRACE environment variable. begin
+// returns the event to pass to end, that ignores negative values.
+int glua_trace_begin(const char * name);
+void glua_trace_end(int event);
+
@@ -0,0 +1,730 @@
+#include "glua_internal.h"
+
+#include <errno.h>
+
+#include "lualib.h"
+
+// --------------------------------------------------------------------------------
+// Embedded archive: its index, the package searcher of its modules, the assets
+// as glua.asset views and as files of the embedded filesystem, and the
+// building of the archive when packing.
+
+glua_archive_t glua_archive;
+
+void archive_close(glua_archive_t * archive) {
+  free(archive->index);
+  memset(archive, 0, sizeof(*archive));
+}
+
+static int archive_index_is_valid(glua_archive_t * archive, size_t index_size) {
+  glua_archive_header_t * header = &archive->header;
+  if (header->main_entry >= header->entry_count) return 0;
+  if (archive->buckets[0] != 0 || archive->buckets[header->bucket_count] != header->entry_count) return 0;
+  for (unsigned int b = 0; b < header->bucket_count; b++) {
+    if (archive->buckets[b] > archive->buckets[b + 1]) return 0;
+    for (unsigned int i = archive->buckets[b]; i < archive->buckets[b + 1]; i++) {
+      glua_archive_entry_t * entry = archive->entries + i;
+      if ((entry->hash & (header->bucket_count - 1)) != b) return 0;
+      if (entry->name_offset > header->names_size || entry->name_size > header->names_size - entry->name_offset) return 0;
+      if (entry->offset < index_size || entry->offset > archive->size || entry->size > archive->size - entry->offset) return 0;
+      if (entry->flags & ~(GLUA_PAYLOAD_BYTECODE | GLUA_PAYLOAD_COMPRESSED | GLUA_PAYLOAD_ASSET)) return 0;
+      if ((entry->flags & GLUA_PAYLOAD_ASSET) && (entry->flags != GLUA_PAYLOAD_ASSET || i == header->main_entry)) return 0;
+    }
+  }
+  return 1;
+}
+
+// Read the index of the archive. The reader source is retained, and it must
+// not be released until the archive is closed.
+int archive_open(lua_State *L, glua_archive_t * archive, script_reader_t * reader) {
+  archive_close(archive);
+  archive->memory = reader->memory;
+  archive->file = reader->file;
+  archive->position = reader->file ? glua_ftell(reader->file) : 0;
+  archive->size = reader->remaining;
+
+  const char * chunk = script_fetch(reader, reader->buffer, sizeof(archive->header));
+  if (!chunk || archive->position < 0) goto corrupted;
+  memcpy(&archive->header, chunk, sizeof(archive->header));
+
+  glua_archive_header_t * header = &archive->header;
+  binject_size_t remaining = reader->remaining;
+  if (header->entry_count > remaining / sizeof(glua_archive_entry_t)) goto corrupted;
+  if (header->bucket_count == 0 || (header->bucket_count & (header->bucket_count - 1))) goto corrupted;
+  if (header->bucket_count >= remaining / sizeof(unsigned int) || header->names_size > remaining) goto corrupted;
+  size_t index_size = header->entry_count * sizeof(glua_archive_entry_t)
+    + (header->bucket_count + 1) * sizeof(unsigned int) + header->names_size;
+  if (index_size > remaining) goto corrupted;
+
+  archive->index = (char *) malloc(index_size + 1);
+  if (!archive->index) {
+    lua_pushstring(L, "not enough memory to open the embedded archive");
+    goto error;
+  }
+  chunk = script_fetch(reader, archive->index, index_size);
+  if (!chunk) goto corrupted;
+  if (chunk != archive->index) memcpy(archive->index, chunk, index_size);
+
+  archive->entries = (glua_archive_entry_t *) archive->index;
+  archive->buckets = (unsigned int *) (archive->entries + header->entry_count);
+  archive->names = (const char *) (archive->buckets + header->bucket_count + 1);
+  if (!archive_index_is_valid(archive, sizeof(*header) + index_size)) goto corrupted;
+
+  reader->retained = 1;
+  return 0;
+
+corrupted:
+  lua_pushstring(L, "corrupted embedded archive");
+error:
+  archive_close(archive);
+  return lua_is_bad();
+}
+
+// Find a module or, if flags is GLUA_PAYLOAD_ASSET, an asset
+glua_archive_entry_t * archive_find(glua_archive_t * archive, const char * name, size_t size, int flags) {
+  if (!archive->index) return NULL;
+  unsigned int hash = glua_hash(name, size);
+  unsigned int bucket = hash & (archive->header.bucket_count - 1);
+  for (unsigned int i = archive->buckets[bucket]; i < archive->buckets[bucket + 1]; i++) {
+    glua_archive_entry_t * entry = archive->entries + i;
+    if (entry->hash == hash && entry->name_size == size && (entry->flags & GLUA_PAYLOAD_ASSET) == flags
+    &&  !memcmp(archive->names + entry->name_offset, name, size))
+      return entry;
+  }
+  return NULL;
+}
+
+// Check the data of an entry against its checksum
+int archive_entry_is_intact(glua_archive_t * archive, glua_archive_entry_t * entry) {
+  if (archive->memory)
+    return entry->checksum == binject_crc32c(0, archive->memory + entry->offset, entry->size);
+
+  char * buffer = (char *) malloc(GLUA_LOAD_CHUNK_SIZE);
+  if (!buffer) return 0;
+  unsigned int crc = 0;
+  binject_size_t remaining = entry->size;
+  int result = !glua_fseek(archive->file, archive->position + (long long) entry->offset, SEEK_SET);
+  while (result && remaining > 0) {
+    size_t count = remaining < GLUA_LOAD_CHUNK_SIZE ? remaining : GLUA_LOAD_CHUNK_SIZE;
+    if (count != fread(buffer, 1, count, archive->file)) result = 0;
+    crc = binject_crc32c(crc, buffer, count);
+    remaining -= count;
+  }
+  free(buffer);
+  return result && crc == entry->checksum;
+}
+
+int archive_load(lua_State *L, glua_archive_t * archive, glua_archive_entry_t * entry, const char * chunkname) {
+  if (verify_mode() == GLUA_VERIFY_LAZY && !archive_entry_is_intact(archive, entry)) {
+    lua_pushstring(L, "embedded script is corrupted (checksum mismatch)");
+    return lua_is_bad();
+  }
+
+  // The loads can be nested, through require, so the buffer is not on the stack
+  script_reader_t * reader = (script_reader_t *) calloc(1, sizeof(*reader));
+  if (!reader) {
+    lua_pushstring(L, "not enough memory to load from the embedded archive");
+    return lua_is_bad();
+  }
+  reader->remaining = entry->size;
+  if (archive->memory) {
+    reader->memory = archive->memory + entry->offset;
+  } else {
+    reader->file = archive->file;
+    if (glua_fseek(archive->file, archive->position + (long long) entry->offset, SEEK_SET)) reader->remaining = 0;
+  }
+
+  int status = load_payload(L, reader, entry->flags, chunkname);
+  free(reader);
+  return status;
+}
+
+// package.searchers entry resolving the modules of the embedded archive
+static int archive_searcher(lua_State *L) {
+  size_t size;
+  const char * name = luaL_checklstring(L, 1, &size);
+  glua_archive_entry_t * entry = archive_find(&glua_archive, name, size, 0);
+  if (!entry) {
+#if LUA_VERSION_NUM < 504
+    lua_pushfstring(L, "\n\tno embedded module '%s'", name);
+#else
+    lua_pushfstring(L, "no embedded module '%s'", name);
+#endif
+    return 1;
+  }
+
+  lua_pushfstring(L, "=%s", name);
+  if (!is_lua_ok(archive_load(L, &glua_archive, entry, lua_tostring(L, -1))))
+    return luaL_error(L, "error loading embedded module '%s':\n\t%s", name, lua_tostring(L, -1));
+  lua_pushliteral(L, ":embedded:");
+  return 2;
+}
+
+// Insert the archive searcher just after the preload one, so the embedded
+// modules are found before the ones in the filesystem
+void archive_install_searcher(lua_State *L) {
+  lua_getglobal(L, "package");
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, "searchers");
+    if (lua_istable(L, -1)) {
+      for (int i = (int) lua_rawlen(L, -1); i >= 2; i--) {
+        lua_rawgeti(L, -1, i);
+        lua_rawseti(L, -2, i + 1);
+      }
+      lua_pushcfunction(L, archive_searcher);
+      lua_rawseti(L, -2, 2);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+}
+
+// --------------------------------------------------------------------------------
+
+// Embedded assets: the archive entries returned by require "glua.asset" as
+// read only views. When the archive is in memory, e.g. mapped, a view points
+// to its data, with no copy; otherwise the data is read in the view.
+
+#define GLUA_ASSET_VIEW "glua.asset.view"
+
+typedef struct {
+  const char * data;
+  size_t size;
+  // followed by the data, if it is not in memory
+} asset_view_t;
+
+static asset_view_t * asset_check_view(lua_State *L) {
+  return (asset_view_t *) luaL_checkudata(L, 1, GLUA_ASSET_VIEW);
+}
+
+// Range positions, as in string.sub: the negative ones are from the end
+static size_t asset_start(lua_Integer position, size_t size) {
+  if (position > 0) return (size_t) position;
+  if (position == 0 || position < -(lua_Integer) size) return 1;
+  return size + (size_t) position + 1;
+}
+
+static size_t asset_end(lua_Integer position, size_t size) {
+  if (position > (lua_Integer) size) return size;
+  if (position >= 0) return (size_t) position;
+  if (position < -(lua_Integer) size) return 0;
+  return size + (size_t) position + 1;
+}
+
+// view:sub([i [, j]]), a string with the bytes from i to j
+static int asset_sub(lua_State *L) {
+  asset_view_t * view = asset_check_view(L);
+  size_t start = asset_start(luaL_optinteger(L, 2, 1), view->size);
+  size_t end = asset_end(luaL_optinteger(L, 3, -1), view->size);
+  if (start > end) lua_pushliteral(L, "");
+  else lua_pushlstring(L, view->data + start - 1, end - start + 1);
+  return 1;
+}
+
+// view:byte([i [, j]]), the bytes from i (default 1) to j (default i)
+static int asset_byte(lua_State *L) {
+  asset_view_t * view = asset_check_view(L);
+  lua_Integer first = luaL_optinteger(L, 2, 1);
+  size_t start = asset_start(first, view->size);
+  size_t end = asset_end(luaL_optinteger(L, 3, first), view->size);
+  if (start > end) return 0;
+  int count = (int) (end - start + 1);
+  luaL_checkstack(L, count, "asset slice too long");
+  for (int i = 0; i < count; i++) lua_pushinteger(L, (unsigned char) view->data[start - 1 + i]);
+  return count;
+}
+
+// The pattern has special characters, also after an embedded zero
+static int asset_pattern_is_special(const char * pattern, size_t size) {
+  for (size_t i = 0; i < size; i += strlen(pattern + i) + 1)
+    if (strpbrk(pattern + i, "^$*+?.([%-")) return 1;
+  return 0;
+}
+
+// view:find(pattern [, init [, plain]]), like string.find. Without special
+// characters, or with plain, the view is searched in place; otherwise a
+// string copy of the whole asset is passed to string.find.
+static int asset_find(lua_State *L) {
+  asset_view_t * view = asset_check_view(L);
+  size_t size;
+  const char * pattern = luaL_checklstring(L, 2, &size);
+  size_t init = asset_start(luaL_optinteger(L, 3, 1), view->size);
+  if (init > view->size + 1) {
+    lua_pushnil(L);
+    return 1;
+  }
+  if (!lua_toboolean(L, 4) && asset_pattern_is_special(pattern, size)) {
+    // The string library is always opened, but its global may be changed:
+    // it is taken from the metatable of the strings
+    lua_settop(L, 2);
+    luaL_getmetafield(L, 2, "__index");
+    lua_getfield(L, -1, "find");
+    lua_pushlstring(L, view->data, view->size);
+    lua_pushvalue(L, 2);
+    lua_pushinteger(L, (lua_Integer) init);
+    lua_call(L, 3, LUA_MULTRET);
+    return lua_gettop(L) - 3;
+  }
+
+  if (size == 0) {
+    lua_pushinteger(L, (lua_Integer) init);
+    lua_pushinteger(L, (lua_Integer) init - 1);
+    return 2;
+  }
+  if (size > view->size - (init - 1)) {
+    lua_pushnil(L);
+    return 1;
+  }
+  const char * cur = view->data + init - 1;
+  const char * last = view->data + view->size - size; // last possible start
+  while (cur <= last) {
+    cur = (const char *) memchr(cur, pattern[0], last - cur + 1);
+    if (!cur) break;
+    if (!memcmp(cur, pattern, size)) {
+      lua_pushinteger(L, (lua_Integer) (cur - view->data) + 1);
+      lua_pushinteger(L, (lua_Integer) (cur - view->data + size));
+      return 2;
+    }
+    cur += 1;
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+static int asset_len(lua_State *L) {
+  lua_pushinteger(L, (lua_Integer) asset_check_view(L)->size);
+  return 1;
+}
+
+static int asset_tostring(lua_State *L) {
+  asset_view_t * view = asset_check_view(L);
+  lua_pushlstring(L, view->data, view->size);
+  return 1;
+}
+
+// Push the view of the asset with the given name, or nil plus a message
+static int asset_push(lua_State *L, int as_string) {
+  size_t size;
+  const char * name = luaL_checklstring(L, 1, &size);
+  glua_archive_t * archive = &glua_archive;
+  glua_archive_entry_t * entry = archive_find(archive, name, size, GLUA_PAYLOAD_ASSET);
+  const char * error = NULL;
+  if (!entry) error = "no embedded asset with this name";
+  else if (entry->size > (size_t) -1 - sizeof(asset_view_t)) error = "embedded asset too large";
+  else if (verify_mode() == GLUA_VERIFY_LAZY && !archive_entry_is_intact(archive, entry))
+    error = "embedded asset is corrupted (checksum mismatch)";
+  if (error) {
+    lua_pushnil(L);
+    lua_pushstring(L, error);
+    return 2;
+  }
+
+  if (archive->memory && as_string) {
+    lua_pushlstring(L, archive->memory + entry->offset, entry->size);
+    return 1;
+  }
+  int copy = !archive->memory;
+  asset_view_t * view = (asset_view_t *) lua_newuserdata(L, sizeof(*view) + (copy ? entry->size : 0));
+  view->size = entry->size;
+  view->data = copy ? (const char *) (view + 1) : archive->memory + entry->offset;
+  if (copy && (glua_fseek(archive->file, archive->position + (long long) entry->offset, SEEK_SET)
+  ||  view->size != fread(view + 1, 1, view->size, archive->file))) {
+    lua_pushnil(L);
+    lua_pushstring(L, "can not read the embedded asset");
+    return 2;
+  }
+  if (as_string) {
+    lua_pushlstring(L, view->data, view->size);
+    return 1;
+  }
+  luaL_getmetatable(L, GLUA_ASSET_VIEW);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+// asset.get(name), a read only view of the asset
+static int asset_get_call(lua_State *L) {
+  return asset_push(L, 0);
+}
+
+// asset.string(name), a string copy of the asset
+static int asset_string_call(lua_State *L) {
+  return asset_push(L, 1);
+}
+
+// asset.list(), the names of the assets
+static int asset_list_call(lua_State *L) {
+  glua_archive_t * archive = &glua_archive;
+  lua_newtable(L);
+  int count = 0;
+  for (unsigned int i = 0; archive->index && i < archive->header.entry_count; i++) {
+    glua_archive_entry_t * entry = archive->entries + i;
+    if (!(entry->flags & GLUA_PAYLOAD_ASSET)) continue;
+    lua_pushlstring(L, archive->names + entry->name_offset, entry->name_size);
+    lua_rawseti(L, -2, ++count);
+  }
+  return 1;
+}
+
+int luaopen_glua_asset(lua_State *L) {
+  if (luaL_newmetatable(L, GLUA_ASSET_VIEW)) {
+    lua_createtable(L, 0, 3);
+    lua_pushcfunction(L, asset_sub); lua_setfield(L, -2, "sub");
+    lua_pushcfunction(L, asset_byte); lua_setfield(L, -2, "byte");
+    lua_pushcfunction(L, asset_find); lua_setfield(L, -2, "find");
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, asset_len); lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, asset_tostring); lua_setfield(L, -2, "__tostring");
+  }
+  lua_pop(L, 1);
+
+  lua_createtable(L, 0, 3);
+  lua_pushcfunction(L, asset_get_call); lua_setfield(L, -2, "get");
+  lua_pushcfunction(L, asset_string_call); lua_setfield(L, -2, "string");
+  lua_pushcfunction(L, asset_list_call); lua_setfield(L, -2, "list");
+  return 1;
+}
+
+// --------------------------------------------------------------------------------
+
+// Archive building, for glua_pack
+
+typedef struct {
+  glua_archive_entry_t entry;
+  encoded_script_t script;
+  unsigned int bucket;
+  int is_main;
+} archive_item_t;
+
+static int archive_item_compare(const void * a, const void * b){
+  const archive_item_t * x = (const archive_item_t *) a;
+  const archive_item_t * y = (const archive_item_t *) b;
+  return x->bucket < y->bucket ? -1 : x->bucket > y->bucket;
+}
+
+// Push the modules and the assets tables of the options at options_idx, or
+// nil. It returns true if there is any, and the payload must be an archive.
+int archive_tables(lua_State *L, int options_idx){
+  if (lua_isnoneornil(L, options_idx)) {
+    lua_pushnil(L);
+    lua_pushnil(L);
+    return 0;
+  }
+  lua_getfield(L, options_idx, "modules");
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+  }
+  lua_getfield(L, options_idx, "assets");
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+  }
+  return !lua_isnil(L, -1) || !lua_isnil(L, -2);
+}
+
+// Build an archive with the main script, the modules and the assets in the
+// tables pushed by archive_tables, mapping names to paths. The modules are
+// encoded as the main script, while the assets are embedded as they are. On
+// error, a message is pushed on the stack.
+int build_archive(lua_State *L, encoded_script_t * main_script,
+    glua_pack_options_t * options, encoded_script_t * archive){
+  int result = GENERIC_ERROR;
+  dump_buffer_t names = { 0 };
+  unsigned int count = 1;
+  int tables_idx = lua_gettop(L) - 1; // modules, then assets
+  memset(archive, 0, sizeof(*archive));
+
+  for (int t = 0; t < 2; t++) {
+    if (lua_isnil(L, tables_idx + t)) continue;
+    lua_pushnil(L);
+    while (lua_next(L, tables_idx + t)) {
+      count += 1;
+      lua_pop(L, 1);
+    }
+  }
+  archive_item_t * items = (archive_item_t *) calloc(count, sizeof(*items));
+  if (!items) {
+    lua_pushstring(L, "not enough memory to build the archive");
+    return GENERIC_ERROR;
+  }
+  items[0].script = *main_script;
+  items[0].is_main = 1;
+  main_script->data = NULL;
+
+  // Encode the modules and read the assets
+  unsigned int done = 1;
+  for (int t = 0; t < 2; t++) {
+    int is_asset = t == 1;
+    if (lua_isnil(L, tables_idx + t)) continue;
+    lua_pushnil(L);
+    while (lua_next(L, tables_idx + t)) {
+      size_t name_size;
+      if (lua_type(L, -2) != LUA_TSTRING || lua_type(L, -1) != LUA_TSTRING) {
+        lua_pop(L, 2);
+        lua_pushstring(L, is_asset ? "assets must map asset names to file paths" : "modules must map module names to script paths");
+        goto end;
+      }
+      const char * name = lua_tolstring(L, -2, &name_size);
+      const char * path = lua_tostring(L, -1);
+      archive_item_t * item = items + done;
+      item->entry.name_offset = names.size;
+      item->entry.name_size = name_size;
+      item->entry.hash = glua_hash(name, name_size);
+      if (name_size == 0 || dump_write(L, name, name_size, &names)) {
+        lua_pop(L, 2);
+        lua_pushstring(L, is_asset ? "invalid asset name" : "invalid module name");
+        goto end;
+      }
+      if (is_asset) {
+        item->script.flags = GLUA_PAYLOAD_ASSET;
+        if (NO_ERROR != read_script(path, &item->script.data, &item->script.size)) {
+          lua_pop(L, 2);
+          lua_pushfstring(L, "can not read %s: %s", path, strerror(errno));
+          goto end;
+        }
+      } else if (NO_ERROR != encode_script(L, path, options, &item->script)) {
+        lua_replace(L, -3);
+        lua_pop(L, 1);
+        goto end;
+      }
+      done += 1;
+      lua_pop(L, 1);
+    }
+  }
+
+  // Sort by bucket, a bucket for each entry at least
+  unsigned int bucket_count = 1;
+  while (bucket_count < count) bucket_count *= 2;
+  items[0].entry.hash = glua_hash("", 0);
+  for (unsigned int i = 0; i < count; i++) items[i].bucket = items[i].entry.hash & (bucket_count - 1);
+  qsort(items, count, sizeof(*items), archive_item_compare);
+
+  glua_archive_header_t header = { count, bucket_count, names.size, 0 };
+  size_t index_size = sizeof(header) + count * sizeof(glua_archive_entry_t)
+    + (bucket_count + 1) * sizeof(unsigned int) + names.size;
+  archive->size = index_size;
+  for (unsigned int i = 0; i < count; i++) {
+    items[i].entry.offset = archive->size;
+    items[i].entry.size = items[i].script.size;
+    items[i].entry.flags = items[i].script.flags;
+    items[i].entry.checksum = binject_crc32c(0, items[i].script.data, items[i].script.size);
+    if (items[i].is_main) header.main_entry = i;
+    archive->size += items[i].script.size;
+  }
+
+  archive->data = (char *) malloc(archive->size);
+  if (!archive->data) {
+    lua_pushstring(L, "not enough memory to build the archive");
+    goto end;
+  }
+  archive->flags = GLUA_PAYLOAD_ARCHIVE;
+
+  char * position = archive->data;
+  memcpy(position, &header, sizeof(header));
+  position += sizeof(header);
+  for (unsigned int i = 0; i < count; i++) {
+    memcpy(position, &items[i].entry, sizeof(glua_archive_entry_t));
+    position += sizeof(glua_archive_entry_t);
+  }
+  for (unsigned int b = 0, i = 0; b <= bucket_count; b++) {
+    while (i < count && items[i].bucket < b) i += 1;
+    memcpy(position, &i, sizeof(i));
+    position += sizeof(i);
+  }
+  if (names.size) memcpy(position, names.data, names.size);
+  position += names.size;
+  for (unsigned int i = 0; i < count; i++) {
+    if (items[i].script.size) memcpy(position, items[i].script.data, items[i].script.size);
+    position += items[i].script.size;
+  }
+  result = NO_ERROR;
+
+end:
+  for (unsigned int i = 0; i < count; i++) free(items[i].script.data);
+  free(items);
+  free(names.data);
+  return result;
+}
+
+// --------------------------------------------------------------------------------
+
+// Embedded filesystem: the assets are found also by io.open, io.lines,
+// loadfile and dofile, as read only files relative to the current directory or
+// to the one of the executable. The other paths, and the writes, go to the
+// real filesystem. The embedded files are read from memory, with fmemopen.
+
+#if GLUA_VFS
+
+// File handle of the io library, with the copy of the data when the archive is
+// not in memory
+typedef struct {
+  luaL_Stream stream;
+  char * copy;
+} vfs_stream_t;
+
+static glua_archive_entry_t * vfs_find(const char * path) {
+  size_t size = strlen(path);
+  while (size > 2 && path[0] == '.' && (path[1] == '/' || path[1] == '\\')) {
+    path += 2;
+    size -= 2;
+  }
+  glua_archive_entry_t * entry = archive_find(&glua_archive, path, size, GLUA_PAYLOAD_ASSET);
+  if (entry || !self_binary_path) return entry;
+
+  // Relative to the directory of the executable
+  size_t directory = 0;
+  for (size_t i = 0; self_binary_path[i]; i++)
+    if (self_binary_path[i] == '/' || self_binary_path[i] == '\\') directory = i + 1;
+  if (directory == 0 || size <= directory || memcmp(path, self_binary_path, directory)) return NULL;
+  return archive_find(&glua_archive, path + directory, size - directory, GLUA_PAYLOAD_ASSET);
+}
+
+// Data of the entry: in the archive, or a copy to free when it is not in memory
+static const char * vfs_data(glua_archive_entry_t * entry, char ** copy) {
+  glua_archive_t * archive = &glua_archive;
+  *copy = NULL;
+  if (archive->memory) return archive->memory + entry->offset;
+  if (entry->size >= (size_t) -1) return NULL;
+  *copy = (char *) malloc(entry->size + 1);
+  if (!*copy || glua_fseek(archive->file, archive->position + (long long) entry->offset, SEEK_SET)
+  ||  entry->size != fread(*copy, 1, entry->size, archive->file)) {
+    free(*copy);
+    *copy = NULL;
+  }
+  return *copy;
+}
+
+static int vfs_close(lua_State *L) {
+  vfs_stream_t * file = (vfs_stream_t *) luaL_checkudata(L, 1, LUA_FILEHANDLE);
+  int result = fclose(file->stream.f);
+  free(file->copy);
+  file->copy = NULL;
+  return luaL_fileresult(L, result == 0, NULL);
+}
+
+// Push a file handle of the io library reading the entry, or nil plus a message
+static int vfs_push_file(lua_State *L, glua_archive_entry_t * entry, const char * path) {
+  vfs_stream_t * file = (vfs_stream_t *) lua_newuserdata(L, sizeof(*file));
+  file->stream.f = NULL;
+  file->stream.closef = NULL; // closed, until it is opened
+  file->copy = NULL;
+  luaL_setmetatable(L, LUA_FILEHANDLE);
+
+  // fmemopen may not accept an empty buffer
+  const char * data = vfs_data(entry, &file->copy);
+  if (data && entry->size > 0) file->stream.f = fmemopen((void *) data, entry->size, "rb");
+  else if (data) file->stream.f = fopen("/dev/null", "rb");
+  if (!file->stream.f) {
+    free(file->copy);
+    file->copy = NULL;
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: can not open the embedded file", path);
+    return 2;
+  }
+  file->stream.closef = vfs_close;
+  return 1;
+}
+
+static int vfs_io_open(lua_State *L) {
+  const char * path = luaL_checkstring(L, 1);
+  const char * mode = luaL_optstring(L, 2, "r");
+  glua_archive_entry_t * entry = mode[0] == 'r' && !strchr(mode, '+') ? vfs_find(path) : NULL;
+  if (!entry) return call_original(L);
+  return vfs_push_file(L, entry, path);
+}
+
+// Iterator of io.lines: the upvalues are the one of file:lines and the file,
+// that is closed at end
+static int vfs_lines_next(lua_State *L) {
+  lua_settop(L, 0);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_call(L, 0, LUA_MULTRET);
+  if (lua_isnil(L, 1)) {
+    lua_getfield(L, lua_upvalueindex(2), "close");
+    lua_pushvalue(L, lua_upvalueindex(2));
+    lua_call(L, 1, 0);
+  }
+  return lua_gettop(L);
+}
+
+static int vfs_io_lines(lua_State *L) {
+  const char * path = lua_isnoneornil(L, 1) ? NULL : luaL_checkstring(L, 1);
+  glua_archive_entry_t * entry = path ? vfs_find(path) : NULL;
+  if (!entry) return call_original(L);
+  if (1 != vfs_push_file(L, entry, path)) return luaL_error(L, "%s", lua_tostring(L, -1));
+  lua_replace(L, 1);                  // file, formats...
+  lua_getfield(L, 1, "lines");
+  lua_insert(L, 1);                   // lines, file, formats...
+  lua_pushvalue(L, 2);
+  lua_insert(L, 1);                   // file, lines, file, formats...
+  lua_call(L, lua_gettop(L) - 2, 1);  // file, iterator
+  lua_insert(L, 1);
+  lua_pushcclosure(L, vfs_lines_next, 2);
+  return 1;
+}
+
+// Load the embedded file as luaL_loadfilex does, skipping the first line if it
+// starts with #
+static int vfs_load(lua_State *L, glua_archive_entry_t * entry, const char * path, const char * mode) {
+  char * copy;
+  const char * data = vfs_data(entry, &copy);
+  if (!data) {
+    lua_pushfstring(L, "cannot read %s", path);
+    return LUA_ERRFILE;
+  }
+  size_t skip = 0;
+  if (entry->size > 0 && data[0] == '#')
+    while (skip < entry->size && data[skip] != '\n') skip += 1;
+  lua_pushfstring(L, "@%s", path);
+  int status = luaL_loadbufferx(L, data + skip, entry->size - skip, lua_tostring(L, -1), mode);
+  lua_remove(L, -2);
+  free(copy);
+  return status;
+}
+
+static int vfs_loadfile(lua_State *L) {
+  const char * path = luaL_optstring(L, 1, NULL);
+  glua_archive_entry_t * entry = path ? vfs_find(path) : NULL;
+  if (!entry) return call_original(L);
+  return loadfile_result(L, vfs_load(L, entry, path, luaL_optstring(L, 2, NULL)), 3);
+}
+
+static int vfs_dofile(lua_State *L) {
+  const char * path = luaL_optstring(L, 1, NULL);
+  glua_archive_entry_t * entry = path ? vfs_find(path) : NULL;
+  if (!entry) return call_original(L);
+  lua_settop(L, 1);
+  if (!is_lua_ok(vfs_load(L, entry, path, NULL))) return lua_error(L);
+  lua_call(L, 0, LUA_MULTRET);
+  return lua_gettop(L) - 1;
+}
+
+void vfs_install(lua_State *L) {
+  int assets = 0;
+  for (unsigned int i = 0; glua_archive.index && i < glua_archive.header.entry_count; i++)
+    if (glua_archive.entries[i].flags & GLUA_PAYLOAD_ASSET) assets += 1;
+  if (!assets) return;
+
+  lua_pushglobaltable(L);
+  wrap_function(L, "loadfile", vfs_loadfile);
+  wrap_function(L, "dofile", vfs_dofile);
+  lua_pop(L, 1);
+
+  // The io library is opened now, also if it would be opened lazily
+  if (library_is_available(glua_library_selection, library_find(LUA_IOLIBNAME))) {
+    luaL_requiref(L, LUA_IOLIBNAME, luaopen_io, 1);
+    wrap_function(L, "open", vfs_io_open);
+    wrap_function(L, "lines", vfs_io_lines);
+    lua_pop(L, 1);
+  }
+}
+
+#else // GLUA_VFS
+
+void vfs_install(lua_State *L) {
+  (void) L;
+}
+
+#endif // GLUA_VFS
+
@@ -0,0 +1,249 @@
+#include "glua_internal.h"
+
+#include <stddef.h>
+
+// --------------------------------------------------------------------------------
+
+// Bytecode cache: when the GLUA_CACHE_DIR environment variable names a
+// directory, the scripts that loadfile, dofile and require load from the
+// filesystem are compiled once, and their bytecode is kept there. A cached
+// chunk is used while the canonical path, the modification time and the size
+// of its source, and the lua version do not change. The directory must be
+// owned by the user and not writable by the others, since the cache is trusted.
+
+#if GLUA_CACHE
+
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#define cache_mkdir(path) _mkdir(path)
+#else
+#define cache_mkdir(path) mkdir(path, 0700)
+#endif
+
+// Each cache file starts with this, followed by the canonical path of the
+// source and by the bytecode
+typedef struct {
+  glua_payload_header_t payload;  // GLUA_PAYLOAD_BYTECODE, for the lua version
+  long long mtime;                // of the source, in nanoseconds when available
+  unsigned long long size;        // of the source
+  unsigned int path_size;
+  unsigned int checksum;          // CRC32C of the bytecode: lua does not check it
+} cache_header_t;
+
+static const char * glua_cache_dir = NULL;
+
+// Header expected for the source, or 0 if it can not be read
+static int cache_header_init(cache_header_t * header, const char * path) {
+  struct stat info;
+  if (stat(path, &info) || !S_ISREG(info.st_mode)) return 0;
+  memset(header, 0, sizeof(*header));
+  payload_header_init(&header->payload, GLUA_PAYLOAD_BYTECODE);
+  header->mtime = (long long) info.st_mtime * 1000000000;
+#if defined(__linux__)
+  header->mtime += info.st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+  header->mtime += info.st_mtimespec.tv_nsec;
+#endif
+  header->size = (unsigned long long) info.st_size;
+  header->path_size = (unsigned int) strlen(path);
+  return 1;
+}
+
+// Absolute path of the source with the links resolved, to free: the cache is
+// keyed by it, so the same relative path in different directories does not
+// find the chunk of another file. NULL on error.
+static char * cache_canonical_path(const char * path) {
+#ifdef _WIN32
+  return _fullpath(NULL, path, 0);
+#else
+  return realpath(path, NULL);
+#endif
+}
+
+// Path of the cache file of the source, to free; NULL on allocation error
+static char * cache_file_path(const char * path, const char * suffix) {
+  size_t size = strlen(glua_cache_dir) + strlen(suffix) + 32;
+  char * result = (char *) malloc(size);
+  if (!result) return NULL;
+  snprintf(result, size, "%s/%08x%08x.luac%s", glua_cache_dir,
+    glua_hash(path, strlen(path)), binject_crc32c(0, path, strlen(path)), suffix);
+  return result;
+}
+
+// Load the cached chunk, if it is valid for the header
+static int cache_read(lua_State *L, const char * cache, const char * path, cache_header_t * expected) {
+  FILE * f = fopen(cache, "rb");
+  if (!f) return 0;
+  cache_header_t header;
+  char * data = NULL;
+  long long size = -1;
+  if (1 == fread(&header, sizeof(header), 1, f) && !memcmp(&header, expected, offsetof(cache_header_t, checksum))
+  &&  !glua_fseek(f, 0, SEEK_END) && (size = glua_ftell(f)) > (long long) (sizeof(header) + header.path_size)
+  &&  (unsigned long long) size < (size_t) -1
+  &&  !glua_fseek(f, sizeof(header), SEEK_SET) && (data = (char *) malloc(size)) != NULL
+  &&  (size_t) size - sizeof(header) != fread(data, 1, size - sizeof(header), f)) {
+    free(data);
+    data = NULL;
+  }
+  fclose(f);
+  if (!data) return 0;
+
+  int loaded = 0;
+  size -= sizeof(header);
+  if (!memcmp(data, path, header.path_size)
+  &&  header.checksum == binject_crc32c(0, data + header.path_size, size - header.path_size)) {
+    lua_pushfstring(L, "@%s", path);
+    loaded = is_lua_ok(luaL_loadbufferx(L, data + header.path_size, size - header.path_size, lua_tostring(L, -1), "b"));
+    lua_remove(L, -2);
+    if (!loaded) lua_pop(L, 1); // compile the source again
+  }
+  free(data);
+  return loaded;
+}
+
+// Write the chunk at the top in the cache, in a temporary file renamed at the
+// end, so the other processes never see it partially written. The errors are
+// ignored: the source is just compiled again the next time.
+static void cache_write(lua_State *L, const char * cache, const char * path, cache_header_t * header) {
+  dump_buffer_t dump = {0};
+  if (glua_dump(L, dump_write, &dump, 0)) {
+    free(dump.data);
+    return;
+  }
+  header->checksum = binject_crc32c(0, dump.data, dump.size);
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%d.tmp", (int) getpid());
+  char * temporary = cache_file_path(path, suffix);
+  FILE * f = temporary ? fopen(temporary, "wb") : NULL;
+  if (f) {
+    int failed = 1 != fwrite(header, sizeof(*header), 1, f)
+      || header->path_size != fwrite(path, 1, header->path_size, f)
+      || dump.size != fwrite(dump.data, 1, dump.size, f);
+    failed = fclose(f) || failed;
+#ifdef _WIN32
+    if (!failed) remove(cache); // rename does not replace
+#endif
+    if (failed || rename(temporary, cache)) remove(temporary);
+  }
+  free(temporary);
+  free(dump.data);
+}
+
+// Only the text sources are cached: the precompiled ones are loaded as they are
+static int cache_source_is_text(const char * path) {
+  FILE * f = fopen(path, "rb");
+  if (!f) return 0;
+  int c = getc(f);
+  if (c == '#') { // the first line is skipped, as luaL_loadfilex does
+    while (c != EOF && c != '\n') c = getc(f);
+    c = getc(f);
+  }
+  fclose(f);
+  return c != LUA_SIGNATURE[0];
+}
+
+// Like luaL_loadfilex, through the cache. It is skipped when the mode excludes
+// the text or the binary chunks: the cached ones are both.
+static int cache_loadfile(lua_State *L, const char * path, const char * mode) {
+  if (mode && (!strchr(mode, 't') || !strchr(mode, 'b'))) return luaL_loadfilex(L, path, mode);
+  cache_header_t header;
+  char * canonical = cache_canonical_path(path);
+  char * cache = canonical && cache_header_init(&header, canonical) ? cache_file_path(canonical, "") : NULL;
+  if (!cache) {
+    free(canonical);
+    return luaL_loadfilex(L, path, mode);
+  }
+
+  int status = LUA_OK;
+  if (!cache_read(L, cache, canonical, &header)) {
+    status = luaL_loadfilex(L, path, mode);
+    if (is_lua_ok(status) && cache_source_is_text(path)) cache_write(L, cache, canonical, &header);
+  }
+  free(cache);
+  free(canonical);
+  return status;
+}
+
+static int cache_loadfile_wrapper(lua_State *L) {
+  const char * path = luaL_optstring(L, 1, NULL);
+  if (!path) return call_original(L); // standard input
+  return loadfile_result(L, cache_loadfile(L, path, luaL_optstring(L, 2, NULL)), 3);
+}
+
+static int cache_dofile_wrapper(lua_State *L) {
+  const char * path = luaL_optstring(L, 1, NULL);
+  if (!path) return call_original(L);
+  lua_settop(L, 1);
+  if (!is_lua_ok(cache_loadfile(L, path, NULL))) return lua_error(L);
+  lua_call(L, 0, LUA_MULTRET);
+  return lua_gettop(L) - 1;
+}
+
+// Replacement of the lua searcher of package.searchers: the package table is
+// the upvalue
+static int cache_searcher(lua_State *L) {
+  const char * name = luaL_checkstring(L, 1);
+  lua_getfield(L, lua_upvalueindex(1), "searchpath");
+  lua_pushstring(L, name);
+  lua_getfield(L, lua_upvalueindex(1), "path");
+  if (!lua_isstring(L, -1)) return luaL_error(L, "'package.path' must be a string");
+  lua_call(L, 2, 2);
+  if (lua_isnil(L, -2)) return 1; // the message of the files tried
+  lua_pop(L, 1);
+  const char * path = lua_tostring(L, -1);
+  if (!is_lua_ok(cache_loadfile(L, path, NULL)))
+    return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s", name, path, lua_tostring(L, -1));
+  lua_insert(L, -2);
+  return 2;
+}
+
+// The cached bytecode is loaded as it is, and lua does not validate it: the
+// directory must be writable only by the user
+static int cache_directory_is_trusted(const char * directory) {
+  struct stat info;
+  if (stat(directory, &info) || !S_ISDIR(info.st_mode)) return 0;
+#ifndef _WIN32
+  if (info.st_uid != geteuid() || (info.st_mode & (S_IWGRP | S_IWOTH))) return 0;
+#endif
+  return 1;
+}
+
+void cache_install(lua_State *L) {
+  const char * directory = getenv("GLUA_CACHE_DIR");
+  if (!directory || !directory[0]) return;
+  cache_mkdir(directory); // it may exist already
+  if (!cache_directory_is_trusted(directory)) {
+    fprintf(stderr, "GLUA_CACHE_DIR: %s is not a directory of the user, writable only by them: the cache is disabled\n", directory);
+    return;
+  }
+  glua_cache_dir = directory;
+
+  lua_pushglobaltable(L);
+  wrap_function(L, "loadfile", cache_loadfile_wrapper);
+  wrap_function(L, "dofile", cache_dofile_wrapper);
+  lua_pop(L, 1);
+
+  // The lua searcher is the second one, until the archive one is added
+  lua_getglobal(L, "package");
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, "searchers");
+    lua_getfield(L, -2, "searchpath");
+    if (lua_istable(L, -2) && lua_isfunction(L, -1)) {
+      lua_pushvalue(L, -3);
+      lua_pushcclosure(L, cache_searcher, 1);
+      lua_rawseti(L, -3, 2);
+    }
+    lua_pop(L, 2);
+  }
+  lua_pop(L, 1);
+}
+
+#else // GLUA_CACHE
+
+void cache_install(lua_State *L) {
+  (void) L;
+}
+
+#endif // GLUA_CACHE
+
@@ -0,0 +1,306 @@
+#ifndef _GLUA_INTERNAL_H_
+#define _GLUA_INTERNAL_H_
+
+// --------------------------------------------------------------------------------
+// Internals shared by the glua*.c files: the payload format, the archive, and
+// the helpers of glua.c used by the archive, the profiler and the cache. They
+// are not part of the API. It must be included before any system header.
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // fmemopen
+#endif
+
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64 // 64-bit off_t also on 32-bit systems
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unistd.h"
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "binject.h"
+
+// --------------------------------------------------------------------------------
+
+#ifdef LUA_OK
+ #define is_lua_ok(status_code) (LUA_OK == status_code)
+#else
+ #define is_lua_ok(status_code) (!status_code)
+#endif
+
+#ifdef LUA_OK
+  #define lua_is_bad() (!LUA_OK)
+#else
+  #define lua_is_bad() (is_lua_ok(0) ? 1 : 0)
+#endif
+
+// lua_dump can strip the debug information since lua 5.3
+#if LUA_VERSION_NUM >= 503
+#define glua_dump(L, writer, data, strip) lua_dump(L, writer, data, strip)
+#else
+#define glua_dump(L, writer, data, strip) ((void) (strip), lua_dump(L, writer, data))
+#endif
+
+// File positions are 64-bit everywhere, as in binject
+#ifdef _WIN32
+#define glua_fseek _fseeki64
+#define glua_ftell _ftelli64
+#else
+#define glua_fseek fseeko
+#define glua_ftell ftello
+#endif
+
+// Hash of the names in the archive (it is part of its format), of the stacks
+// in the profiler and of the cached paths
+unsigned int glua_hash(const char * name, size_t size);
+
+// Path of the running executable, NULL if it is not known
+extern char * self_binary_path;
+
+// --------------------------------------------------------------------------------
+// Standard libraries
+
+// Libraries selected by the running payload, see GLUA_LIBRARIES_SELECTED
+extern unsigned int glua_library_selection;
+
+// Index of the library in the glua.c list, or -1
+int library_find(const char * name);
+
+int library_is_available(unsigned int selection, int index);
+
+// --------------------------------------------------------------------------------
+// Payload
+
+// Size of the chunks passed to the lua loader when the script is read from a
+// file. It should be a positive integer
+#ifndef GLUA_LOAD_CHUNK_SIZE
+#define GLUA_LOAD_CHUNK_SIZE (16384)
+#endif // GLUA_LOAD_CHUNK_SIZE
+
+// Header of the payloads that are not plain lua scripts. The magic starts
+// with the first byte of the lua binary chunks, so it can not be confused with
+// a source script, nor it can be loaded as bytecode.
+#define GLUA_PAYLOAD_MAGIC "\x1bGLU"
+#define GLUA_PAYLOAD_VERSION (1)
+
+#define GLUA_PAYLOAD_BYTECODE (0x01)    // lua_dump output
+#define GLUA_PAYLOAD_COMPRESSED (0x02)  // sequence of compressed blocks
+#define GLUA_PAYLOAD_ARCHIVE (0x04)     // main script and modules, see glua_archive_header_t
+#define GLUA_PAYLOAD_ASSET (0x08)       // archive entry with data for glua.asset, not a script
+#define GLUA_PAYLOAD_KNOWN_FLAGS (GLUA_PAYLOAD_BYTECODE | GLUA_PAYLOAD_COMPRESSED | GLUA_PAYLOAD_ARCHIVE)
+
+// Size of the blocks of the compressed payloads, before the compression. It
+// is also the size of the buffer used to decompress them.
+#ifndef GLUA_COMPRESS_BLOCK_SIZE
+#define GLUA_COMPRESS_BLOCK_SIZE (65536)
+#endif // GLUA_COMPRESS_BLOCK_SIZE
+
+// Each compressed block starts with this
+typedef struct {
+  unsigned int packed_size;  // if equal to raw_size, the block is stored uncompressed
+  unsigned int raw_size;
+} glua_block_header_t;
+
+typedef struct {
+  char magic[4];               // GLUA_PAYLOAD_MAGIC, without the final \0
+  unsigned char version;       // GLUA_PAYLOAD_VERSION
+  unsigned char flags;         // GLUA_PAYLOAD_* bit mask
+  unsigned char lua_major;     // lua version used to generate the payload
+  unsigned char lua_minor;
+  unsigned char integer_size;  // sizeof(lua_Integer)
+  unsigned char number_size;   // sizeof(lua_Number)
+  unsigned short libraries;    // GLUA_LIBRARIES_SELECTED and the selected ones, or 0 for all
+  unsigned int memory_limit;   // in KiB, 0 for none
+} glua_payload_header_t;
+
+void payload_header_init(glua_payload_header_t * header, int flags);
+
+// Source of the main chunk: a script in memory, or a file positioned at its
+// begin that is read one chunk at time
+typedef struct {
+  const char * memory;
+  FILE * file;
+  binject_size_t remaining;
+  size_t pending;  // bytes already read in the buffer, to be returned first
+  int retained;    // the source is still used after the load, by the archive
+  char buffer[GLUA_LOAD_CHUNK_SIZE];
+} script_reader_t;
+
+// Return the next size bytes of the script: a pointer in memory, or a copy in
+// the buffer. NULL if they can not be read.
+const char * script_fetch(script_reader_t * reader, char * buffer, size_t size);
+
+// Load a script, bytecode or compressed data, as described by the flags
+int load_payload(lua_State *L, script_reader_t * reader, int flags, const char * chunkname);
+
+// The GLUA_VERIFY environment variable selects when the embedded payload is
+// checked against its checksum, see verify_mode
+#define GLUA_VERIFY_NONE (0)
+#define GLUA_VERIFY_LAZY (1)
+#define GLUA_VERIFY_STARTUP (2)
+
+int verify_mode(void);
+
+// --------------------------------------------------------------------------------
+// Packing
+
+typedef struct {
+  int section;  // move the script in a section mapped by the loader
+  int compile;  // embed the bytecode instead of the source
+  int strip;    // strip debug information from the bytecode
+  int compress; // compress the payload
+  unsigned int libraries; // standard libraries the script can use, see glua_library_selection
+  unsigned int memory_limit; // in KiB, 0 for none
+  int update;   // replace the payload of the output generated before, if possible
+} glua_pack_options_t;
+
+// Script ready to be embedded
+typedef struct {
+  char * data;
+  size_t size;
+  int flags;  // GLUA_PAYLOAD_* flags describing the data
+} encoded_script_t;
+
+// Growing buffer, filled by the lua_Writer dump_write
+typedef struct {
+  char * data;
+  size_t size;
+  size_t capacity;
+} dump_buffer_t;
+
+int dump_write(lua_State *L, const void * p, size_t size, void * ud);
+
+// Read the whole file in a buffer to free
+int read_script(const char * scr_path, char ** data, size_t * size);
+
+// Read the script and, as requested by the options, compile and compress it.
+// On error, a message is pushed on the stack.
+int encode_script(lua_State *L, const char * path, glua_pack_options_t * options, encoded_script_t * script);
+
+// --------------------------------------------------------------------------------
+// Archive, in glua_archive.c
+
+// The archive payload contains the main script and the modules it can
+// require. After the payload header there are:
+// - the glua_archive_header_t
+// - entry_count glua_archive_entry_t, sorted by bucket
+// - bucket_count + 1 unsigned int, the first entry of each bucket
+// - the names of the entries, not zero terminated
+// - the data of the entries
+// Offsets are from the begin of the archive, i.e. just after the payload header.
+typedef struct {
+  unsigned int entry_count;
+  unsigned int bucket_count;  // power of 2
+  unsigned int names_size;
+  unsigned int main_entry;    // the script to run
+} glua_archive_header_t;
+
+typedef struct {
+  unsigned long long offset;
+  unsigned long long size;
+  unsigned int hash;          // glua_hash of the name, it selects the bucket
+  unsigned int name_offset;   // position in the names
+  unsigned int name_size;
+  unsigned int flags;         // GLUA_PAYLOAD_* flags of the data
+  unsigned int checksum;      // binject_crc32c of the data
+  unsigned int reserved;
+} glua_archive_entry_t;
+
+// Archive of the running binary. Its source is kept after the load of the
+// main script, since the modules are loaded only when they are required.
+typedef struct {
+  const char * memory;  // the archive is in memory, or
+  FILE * file;          // in a file, at this position
+  long long position;
+  binject_size_t size;
+  glua_archive_header_t header;
+  glua_archive_entry_t * entries;
+  unsigned int * buckets;
+  const char * names;
+  char * index;         // allocation holding entries, buckets and names
+} glua_archive_t;
+
+extern glua_archive_t glua_archive;
+
+void archive_close(glua_archive_t * archive);
+
+// Read the index of the archive. The reader source is retained, and it must
+// not be released until the archive is closed.
+int archive_open(lua_State *L, glua_archive_t * archive, script_reader_t * reader);
+
+// Find a module or, if flags is GLUA_PAYLOAD_ASSET, an asset
+glua_archive_entry_t * archive_find(glua_archive_t * archive, const char * name, size_t size, int flags);
+
+// Check the data of an entry against its checksum
+int archive_entry_is_intact(glua_archive_t * archive, glua_archive_entry_t * entry);
+
+int archive_load(lua_State *L, glua_archive_t * archive, glua_archive_entry_t * entry, const char * chunkname);
+
+// Insert the archive searcher in package.searchers
+void archive_install_searcher(lua_State *L);
+
+// Push the modules and the assets tables of the options at options_idx, or
+// nil. It returns true if there is any, and the payload must be an archive.
+int archive_tables(lua_State *L, int options_idx);
+
+// Build an archive with the main script and the tables pushed by
+// archive_tables. On error, a message is pushed on the stack.
+int build_archive(lua_State *L, encoded_script_t * main_script,
+    glua_pack_options_t * options, encoded_script_t * archive);
+
+int luaopen_glua_asset(lua_State *L);
+
+// --------------------------------------------------------------------------------
+// Wrappers of the standard functions
+
+// The embedded filesystem and the bytecode cache replace some standard
+// functions with wrappers, that get the original one as first upvalue.
+
+#if !defined(GLUA_VFS) && LUA_VERSION_NUM >= 502 && defined(LUA_FILEHANDLE) \
+  && defined(_POSIX_VERSION) && _POSIX_VERSION >= 200809L
+#define GLUA_VFS 1
+#endif
+
+#if !defined(GLUA_CACHE) && LUA_VERSION_NUM >= 502
+#define GLUA_CACHE 1
+#endif
+
+#if GLUA_VFS || GLUA_CACHE
+
+// Call the original function, the first upvalue, with the same arguments
+int call_original(lua_State *L);
+
+// Replace the function in the table at the top with the wrapper, that has the
+// original one as upvalue
+void wrap_function(lua_State *L, const char * name, lua_CFunction wrapper);
+
+// Return value of loadfile: the chunk, with the environment of the argument
+// env_index if given, or nil and the message
+int loadfile_result(lua_State *L, int status, int env_index);
+
+#endif // GLUA_VFS || GLUA_CACHE
+
+// Embedded filesystem, in glua_archive.c: it does nothing without assets
+void vfs_install(lua_State *L);
+
+// Bytecode cache, in glua_cache.c: it does nothing without GLUA_CACHE_DIR
+void cache_install(lua_State *L);
+
+// --------------------------------------------------------------------------------
+// Profiler, in glua_profile.c
+
+// Profile the script run if GLUA_PROFILE is set
+void profile_script_start(lua_State *L);
+
+// Stop the sampling. The state is not accessed if L is NULL, e.g. at exit.
+void profile_stop(lua_State *L);
+
+// The glua.profile table
+int luaopen_glua_profile(lua_State *L);
+
+// --------------------------------------------------------------------------------
+
+#endif // _GLUA_INTERNAL_H_
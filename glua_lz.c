@@ -0,0 +1,153 @@
+
+#include <string.h>
+#include "glua_lz.h"
+
+// --------------------------------------------------------------------------
+
+#define MIN_MATCH (4)
+#define LAST_LITERALS (5)   // the last bytes are always literals
+#define MATCH_LIMIT (12)    // no match can start in the last bytes
+#define MAX_DISTANCE (65535)
+#define HASH_LOG (12)
+
+static unsigned int read32(const unsigned char * p){
+  unsigned int result;
+  memcpy(&result, p, sizeof(result));
+  return result;
+}
+
+static unsigned int hash32(unsigned int value){
+  return (value * 2654435761u) >> (32 - HASH_LOG);
+}
+
+static unsigned char * write_length(unsigned char * op, int length){
+  while (length >= 255) {
+    *op++ = 255;
+    length -= 255;
+  }
+  *op++ = length;
+  return op;
+}
+
+// Write a sequence: token, literals and, if match_length >= 0, the match
+static unsigned char * write_sequence(unsigned char * op, unsigned char * oend,
+    const unsigned char * literals, int literal_length, int offset, int match_length){
+
+  if (oend - op < 1 + literal_length / 255 + 1 + literal_length + 2 + match_length / 255 + 1)
+    return NULL;
+
+  unsigned char * token = op++;
+  *token = (literal_length < 15 ? literal_length : 15) << 4;
+  if (literal_length >= 15) op = write_length(op, literal_length - 15);
+  memcpy(op, literals, literal_length);
+  op += literal_length;
+
+  if (match_length >= 0) {
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    *token |= match_length < 15 ? match_length : 15;
+    if (match_length >= 15) op = write_length(op, match_length - 15);
+  }
+  return op;
+}
+
+int glua_lz_compress(const char * source, int size, char * destination, int capacity){
+  const unsigned char * src = (const unsigned char *) source;
+  const unsigned char * end = src + size;
+  const unsigned char * anchor = src;
+  const unsigned char * ip = src;
+  unsigned char * op = (unsigned char *) destination;
+  unsigned char * oend = op + capacity;
+  int table[1 << HASH_LOG];
+
+  if (size > MATCH_LIMIT) {
+    const unsigned char * match_start_limit = end - MATCH_LIMIT;
+    const unsigned char * match_end_limit = end - LAST_LITERALS;
+    memset(table, 0, sizeof(table));
+
+    while (ip < match_start_limit) {
+      unsigned int h = hash32(read32(ip));
+      const unsigned char * ref = src + table[h];
+      table[h] = ip - src;
+
+      if (ref >= ip || ip - ref > MAX_DISTANCE || read32(ref) != read32(ip)) {
+        // No match: skip faster on data that does not compress
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+
+      const unsigned char * match_end = ip + MIN_MATCH;
+      const unsigned char * ref_end = ref + MIN_MATCH;
+      while (match_end < match_end_limit && *match_end == *ref_end) {
+        match_end += 1;
+        ref_end += 1;
+      }
+
+      op = write_sequence(op, oend, anchor, ip - anchor, ip - ref, match_end - ip - MIN_MATCH);
+      if (!op) return 0;
+
+      // Index a position inside the match too, it helps on repetitive data
+      if (match_end - 2 < match_start_limit) table[hash32(read32(match_end - 2))] = match_end - 2 - src;
+      ip = anchor = match_end;
+    }
+  }
+
+  op = write_sequence(op, oend, anchor, end - anchor, 0, -1);
+  if (!op) return 0;
+  return op - (unsigned char *) destination;
+}
+
+int glua_lz_decompress(const char * source, int size, char * destination, int capacity){
+  const unsigned char * ip = (const unsigned char *) source;
+  const unsigned char * iend = ip + size;
+  unsigned char * dst = (unsigned char *) destination;
+  unsigned char * op = dst;
+  unsigned char * oend = op + capacity;
+
+  while (ip < iend) {
+    unsigned int token = *ip++;
+
+    // Literals
+    size_t length = token >> 4;
+    if (length == 15) {
+      unsigned int b;
+      do {
+        if (ip >= iend) return -1;
+        b = *ip++;
+        length += b;
+      } while (b == 255);
+    }
+    if (length > (size_t)(iend - ip) || length > (size_t)(oend - op)) return -1;
+    memcpy(op, ip, length);
+    op += length;
+    ip += length;
+    if (ip == iend) break; // the last sequence has no match
+
+    // Match
+    if (iend - ip < 2) return -1;
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+    length = token & 15;
+    if (length == 15) {
+      unsigned int b;
+      do {
+        if (ip >= iend) return -1;
+        b = *ip++;
+        length += b;
+      } while (b == 255);
+    }
+    length += MIN_MATCH;
+    if (length > (size_t)(oend - op)) return -1;
+
+    const unsigned char * match = op - offset;
+    if (offset >= length) {
+      memcpy(op, match, length);
+      op += length;
+    } else {
+      while (length--) *op++ = *match++; // overlapping copy
+    }
+  }
+  return op - dst;
+}
+
@@ -0,0 +1,20 @@
+
+#ifndef _GLUA_LZ_H_
+#define _GLUA_LZ_H_
+
+// Minimal compressor/decompressor for the LZ4 block format (no frame, no
+// checksum). The compressor is a simple greedy one: it is fast and good
+// enough for lua sources and bytecode.
+
+// Worst case size of the compressed data
+#define GLUA_LZ_BOUND(size) ((size) + (size) / 255 + 16)
+
+// Return the size of the compressed data, or 0 if it does not fit in dst
+int glua_lz_compress(const char * src, int size, char * dst, int capacity);
+
+// Return the size of the decompressed data, or -1 if src is not valid or the
+// result does not fit in dst
+int glua_lz_decompress(const char * src, int size, char * dst, int capacity);
+
+#endif // _GLUA_LZ_H_
+
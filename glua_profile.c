@@ -0,0 +1,275 @@
+#include "glua_internal.h"
+
+#include <signal.h>
+
+// --------------------------------------------------------------------------------
+
+// Sampling profiler. A SIGPROF timer arms a count hook, as the SIGINT handler
+// of glua.c does, and at the next instruction the hook writes the lua stack,
+// as a folded stack, in a preallocated ring. When the ring is full its samples
+// are counted in a table, that is written at end in the folded format of the
+// flame graph tools ("frame;frame;frame count" lines). Only the thread that
+// started the profiler is sampled.
+// The GLUA_PROFILE environment variable names the file where the profile of
+// the whole script is written, GLUA_PROFILE_HZ sets the sampling frequency.
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/time.h>
+#endif
+#if defined(SA_RESTART) && defined(ITIMER_PROF)
+#define GLUA_PROFILER
+#endif
+
+#ifndef GLUA_PROFILE_HZ
+#define GLUA_PROFILE_HZ (997) // not a multiple of common periods
+#endif // GLUA_PROFILE_HZ
+
+#define GLUA_PROFILE_RING_SIZE (256)     // samples
+#define GLUA_PROFILE_SAMPLE_SIZE (1024)  // maximum length of a folded stack
+#define GLUA_PROFILE_DEPTH (64)          // maximum frames of a stack
+
+typedef struct {
+  char * stack;
+  unsigned long long count;
+} profile_entry_t;
+
+static struct {
+  lua_State * L;             // sampled state, NULL when stopped
+  char * ring;               // GLUA_PROFILE_RING_SIZE samples
+  int ring_count;
+  profile_entry_t * table;   // open addressing, by stack
+  unsigned int table_size;   // power of 2
+  unsigned int table_count;
+  unsigned long long dropped;
+} glua_profile;
+
+static void profile_count(const char * stack) {
+  if (glua_profile.table_count * 2 >= glua_profile.table_size) {
+    unsigned int size = glua_profile.table_size ? 2 * glua_profile.table_size : 256;
+    profile_entry_t * table = (profile_entry_t *) calloc(size, sizeof(*table));
+    if (!table) {
+      glua_profile.dropped += 1;
+      return;
+    }
+    for (unsigned int i = 0; i < glua_profile.table_size; i++) {
+      profile_entry_t * entry = glua_profile.table + i;
+      if (!entry->stack) continue;
+      unsigned int j = glua_hash(entry->stack, strlen(entry->stack)) & (size - 1);
+      while (table[j].stack) j = (j + 1) & (size - 1);
+      table[j] = *entry;
+    }
+    free(glua_profile.table);
+    glua_profile.table = table;
+    glua_profile.table_size = size;
+  }
+
+  unsigned int mask = glua_profile.table_size - 1;
+  unsigned int i = glua_hash(stack, strlen(stack)) & mask;
+  for (; glua_profile.table[i].stack; i = (i + 1) & mask) {
+    if (!strcmp(glua_profile.table[i].stack, stack)) {
+      glua_profile.table[i].count += 1;
+      return;
+    }
+  }
+  char * copy = (char *) malloc(strlen(stack) + 1);
+  if (!copy) {
+    glua_profile.dropped += 1;
+    return;
+  }
+  strcpy(copy, stack);
+  glua_profile.table[i].stack = copy;
+  glua_profile.table[i].count = 1;
+  glua_profile.table_count += 1;
+}
+
+static void profile_drain(void) {
+  for (int i = 0; i < glua_profile.ring_count; i++)
+    profile_count(glua_profile.ring + i * GLUA_PROFILE_SAMPLE_SIZE);
+  glua_profile.ring_count = 0;
+}
+
+// Append a frame to the folded stack, without the separators of the format
+static size_t profile_frame(char * out, size_t size, lua_Debug * ar) {
+  int length;
+  if (*ar->what == 'm') length = snprintf(out, size, "main chunk (%s)", ar->short_src);
+  else if (*ar->what == 'C') length = snprintf(out, size, "[C] %s", ar->name ? ar->name : "?");
+  else length = snprintf(out, size, "%s (%s:%d)", ar->name ? ar->name : "?", ar->short_src, ar->linedefined);
+  if (length < 0 || (size_t) length >= size) return 0;
+  for (int i = 0; i < length; i++) if (out[i] == ';' || out[i] == '\n') out[i] = ':';
+  return length;
+}
+
+static void profile_hook(lua_State *L, lua_Debug *ar) {
+  (void) ar;
+  lua_sethook(L, NULL, 0, 0);
+  if (glua_profile.ring_count >= GLUA_PROFILE_RING_SIZE) profile_drain();
+
+  // The frames are written from the outermost one
+  lua_Debug frames[GLUA_PROFILE_DEPTH];
+  int depth = 0;
+  while (depth < GLUA_PROFILE_DEPTH && lua_getstack(L, depth, frames + depth)) {
+    lua_getinfo(L, "Sn", frames + depth);
+    depth += 1;
+  }
+  if (depth == 0) return;
+
+  char * sample = glua_profile.ring + glua_profile.ring_count * GLUA_PROFILE_SAMPLE_SIZE;
+  size_t length = 0;
+  for (int i = depth - 1; i >= 0; i--) {
+    size_t frame = profile_frame(sample + length, GLUA_PROFILE_SAMPLE_SIZE - length - 1, frames + i);
+    if (frame == 0) break; // too deep: keep the outermost frames
+    length += frame;
+    if (i > 0) sample[length++] = ';';
+  }
+  if (length > 0 && sample[length - 1] == ';') length -= 1;
+  sample[length] = '\0';
+  glua_profile.ring_count += 1;
+}
+
+#ifdef GLUA_PROFILER
+static void profile_signal_handler(int i) {
+  (void) i;
+  lua_State *L = glua_profile.L;
+  if (L && !lua_gethook(L)) lua_sethook(L, profile_hook, LUA_MASKCOUNT, 1); // do not replace other hooks
+}
+#endif // GLUA_PROFILER
+
+// Start to sample the thread, returning NULL or an error message
+static const char * profile_start(lua_State *L, int frequency) {
+#ifndef GLUA_PROFILER
+  return "the profiler is not available on this system";
+#else // GLUA_PROFILER
+  if (glua_profile.L) return "the profiler is already running";
+  if (frequency <= 0 || frequency > 1000000) return "invalid sampling frequency";
+  if (!glua_profile.ring) glua_profile.ring = (char *) malloc(GLUA_PROFILE_RING_SIZE * GLUA_PROFILE_SAMPLE_SIZE);
+  if (!glua_profile.ring) return "not enough memory for the profiler";
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = profile_signal_handler;
+  action.sa_flags = SA_RESTART; // do not interrupt the io of the script
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, NULL)) return "can not handle SIGPROF";
+
+  glua_profile.L = L;
+  struct itimerval timer;
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = 1000000 / frequency;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, NULL)) {
+    glua_profile.L = NULL;
+    return "can not start the profiling timer";
+  }
+  return NULL;
+#endif // GLUA_PROFILER
+}
+
+// Stop the sampling. The state is not accessed if L is NULL, e.g. at exit.
+void profile_stop(lua_State *L) {
+#ifdef GLUA_PROFILER
+  if (!glua_profile.L) return;
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  signal(SIGPROF, SIG_IGN); // a late signal must not terminate the process
+  if (L && lua_gethook(L) == profile_hook) lua_sethook(L, NULL, 0, 0);
+  glua_profile.L = NULL;
+  profile_drain();
+#endif // GLUA_PROFILER
+}
+
+// Write the counted stacks, and clear them
+static int profile_write(FILE * f) {
+  int result = 0;
+  for (unsigned int i = 0; i < glua_profile.table_size; i++) {
+    profile_entry_t * entry = glua_profile.table + i;
+    if (!entry->stack) continue;
+    if (f && 0 > fprintf(f, "%s %llu\n", entry->stack, entry->count)) result = -1;
+    free(entry->stack);
+  }
+  free(glua_profile.table);
+  glua_profile.table = NULL;
+  glua_profile.table_size = 0;
+  glua_profile.table_count = 0;
+  return result;
+}
+
+static int profile_write_file(const char * path) {
+  FILE * f = fopen(path, "w");
+  int result = profile_write(f);
+  if (!f || fclose(f)) result = -1;
+  return result;
+}
+
+static void profile_at_exit(void) {
+  profile_stop(NULL);
+  profile_write_file(getenv("GLUA_PROFILE"));
+}
+
+// Profile the script run if GLUA_PROFILE is set
+void profile_script_start(lua_State *L) {
+  const char * output = getenv("GLUA_PROFILE");
+  if (!output || output[0] == '\0') return;
+  const char * frequency = getenv("GLUA_PROFILE_HZ");
+  const char * error = profile_start(L, frequency ? atoi(frequency) : GLUA_PROFILE_HZ);
+  if (error) fprintf(stderr, "GLUA_PROFILE: %s\n", error);
+  else atexit(profile_at_exit); // written at exit, also if the script calls os.exit
+}
+
+// --------------------------------------------------------------------------------
+
+// glua.profile.start([frequency]) starts to sample the running thread, 997
+// times per second of cpu time by default
+static int glua_profile_start_call(lua_State* L){
+  const char * error = profile_start(L, (int) luaL_optinteger(L, 1, GLUA_PROFILE_HZ));
+  if (error) {
+    lua_pushnil(L);
+    lua_pushstring(L, error);
+    return 2;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+// glua.profile.stop([path]) stops the sampling, and writes the folded stacks in
+// the file, or returns them as a string
+static int glua_profile_stop_call(lua_State* L){
+  const char * path = luaL_optstring(L, 1, NULL);
+  if (glua_profile.L != L) {
+    lua_pushnil(L);
+    lua_pushstring(L, glua_profile.L ? "the profiler was started by another thread" : "the profiler is not running");
+    return 2;
+  }
+  profile_stop(L);
+  if (path) {
+    if (profile_write_file(path)) {
+      lua_pushnil(L);
+      lua_pushfstring(L, "can not write %s", path);
+      return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+
+  luaL_Buffer buffer;
+  luaL_buffinit(L, &buffer);
+  for (unsigned int i = 0; i < glua_profile.table_size; i++) {
+    profile_entry_t * entry = glua_profile.table + i;
+    if (!entry->stack) continue;
+    char count[32];
+    snprintf(count, sizeof(count), " %llu\n", entry->count);
+    luaL_addstring(&buffer, entry->stack);
+    luaL_addstring(&buffer, count);
+  }
+  profile_write(NULL);
+  luaL_pushresult(&buffer);
+  return 1;
+}
+
+int luaopen_glua_profile(lua_State* L){
+  lua_createtable(L, 0, 2);
+  lua_pushcfunction(L, glua_profile_start_call); lua_setfield(L, -2, "start");
+  lua_pushcfunction(L, glua_profile_stop_call); lua_setfield(L, -2, "stop");
+  return 1;
+}
+
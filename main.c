@@ -12,8 +12,10 @@
 #undef luaL_openlibs(...)
 
 int main(int argc, char **argv) {
+  glua_trace_begin("main"); // closed at exit
 
   // Set the binary path
+  int trace = glua_trace_begin("whereami");
 #ifndef USE_WHEREAMI
   set_self_binary_path(argv[0]);
 #else // USE_WHEREAMI
@@ -32,8 +34,13 @@ int main(int argc, char **argv) {
     set_self_binary_path(argv[0]);
   }
 #endif // USE_WHEREAMI
+  glua_trace_end(trace);
 
-  if (binject_main_app_has_internal_script()){
+  trace = glua_trace_begin("find_script");
+  int has_script = binject_main_app_has_internal_script();
+  glua_trace_end(trace);
+
+  if (has_script){
     // Script found: run it
     return binject_main_app_internal_script_handle(0, argc, argv);
   } else {
@@ -0,0 +1,90 @@
+#!/bin/sh
+
+echo "Comparing compressed and uncompressed tail payloads (size and startup time)."
+
+#############################################################
+# Configuration
+
+# Directory of a compiled lua source tree: it must contain the headers, lua.c
+# and liblua.a
+LUA_DIR="${LUA_DIR:-$HOME/lua/src}"
+
+# Number of launches for each executable
+RUNS="${RUNS:-50}"
+
+# Approximate size of the generated script, in byte
+SCRIPT_SIZE="${SCRIPT_SIZE:-2000000}"
+
+TEST_DIR="$(readlink -f "$(dirname "$0")")/tmp_bench"
+CC="gcc -O2 -I../.. -I$LUA_DIR"
+
+rm -fR "$TEST_DIR"
+mkdir "$TEST_DIR"
+cd "$TEST_DIR"
+
+#############################################################
+# Compile, always using the tail method
+
+$CC -D'BINJECT_ARRAY_SIZE=3' -DUSE_WHEREAMI -DENABLE_STANDARD_LUA_CLI="\"$LUA_DIR/lua.c\"" \
+  -o ./glua.exe ../../*.c "$LUA_DIR/liblua.a" -pthread -lm -ldl || exit 1
+strip ./glua.exe
+
+#############################################################
+# Generate the script: a big data table, as generated sources often are
+
+lua_script() {
+  echo "local data = {"
+  I=0
+  SIZE=0
+  while [ "$SIZE" -lt "$SCRIPT_SIZE" ] ; do
+    echo "  { id = $I, name = \"item_$I\", tags = { \"a$((I % 7))\", \"b$((I % 11))\" }, value = $I.5 },"
+    I=$((I + 1))
+    SIZE=$((SIZE + 80))
+  done
+  echo "}"
+  echo "print(#data)"
+}
+lua_script > ./script.lua
+
+#############################################################
+# Pack
+
+pack() {
+  ./glua.exe -e "require'glua_pack'('script.lua', '$1', $2)" || exit 1
+  chmod ugo+x "./$1"
+}
+
+pack plain.exe "{}"
+pack compressed.exe "{compress = true}"
+pack bytecode.exe "{compile = true}"
+pack bytecode_compressed.exe "{compile = true, compress = true}"
+
+#############################################################
+# Measure
+
+EXPECTED="$(./plain.exe)"
+
+measure() {
+  RES="$(./"$1")"
+  if [ "$RES" != "$EXPECTED" ] ; then
+    echo "TEST FAILS ! $1 printed >>>$RES<<< instead of >>>$EXPECTED<<<"
+    exit 1
+  fi
+  START=$(date +%s%N)
+  I=0
+  while [ "$I" -lt "$RUNS" ] ; do
+    ./"$1" > /dev/null
+    I=$((I + 1))
+  done
+  STOP=$(date +%s%N)
+  SIZE=$(wc -c < "./$1")
+  printf "%-26s %12d byte %10d us/run\n" "$1" "$SIZE" "$(( (STOP - START) / RUNS / 1000 ))"
+}
+
+echo "script.lua: $(wc -c < ./script.lua) byte, runtime: $(wc -c < ./glua.exe) byte, $RUNS runs"
+measure plain.exe
+measure compressed.exe
+measure bytecode.exe
+measure bytecode_compressed.exe
+
+echo "ALL RIGHT"
@@ -0,0 +1,197 @@
+#!/bin/sh
+
+echo "Measuring the startup of glued executables (latency, peak RSS, syscalls)."
+
+#############################################################
+# Configuration
+
+# Directory of a compiled lua source tree: it must contain the headers, lua.c
+# and liblua.a
+LUA_DIR="${LUA_DIR:-$HOME/lua/src}"
+LUA_CLI="${LUA_CLI:-$LUA_DIR/lua.c}"
+LUA_LIB="${LUA_LIB:-$LUA_DIR/liblua.a}"
+
+# Number of warm and cold launches for each executable
+RUNS="${RUNS:-20}"
+COLD_RUNS="${COLD_RUNS:-5}"
+
+# Approximate sizes of the generated scripts, in byte
+SIZES="${SIZES:-100 10000 1000000 50000000}"
+
+# Size of the internal array of the "array" runtime
+ARRAY_SIZE="${ARRAY_SIZE:-9216}"
+
+TEST_DIR="$(readlink -f "$(dirname "$0")")/tmp_bench_startup"
+OUT="${OUT:-$TEST_DIR/results.json}"
+CC="${CC:-gcc -O2} -I../.. -I$LUA_DIR"
+
+rm -fR "$TEST_DIR"
+mkdir "$TEST_DIR"
+cd "$TEST_DIR"
+
+#############################################################
+# Compile the runtimes: the "array" one falls back to the tail method only
+# for the scripts that do not fit, the "tail" one always uses it
+
+build() {
+  $CC -D"BINJECT_ARRAY_SIZE=$2" -DUSE_WHEREAMI -DENABLE_STANDARD_LUA_CLI="\"$LUA_CLI\"" \
+    -o "./$1" ../../*.c $LUA_LIB -pthread -lm -ldl || exit 1
+  strip "./$1"
+}
+
+build array.exe "$ARRAY_SIZE"
+build tail.exe 3
+
+#############################################################
+# Optional tools
+
+# Cold launches drop the page cache of the whole system when possible (root),
+# otherwise just the one of the executable
+if [ -w /proc/sys/vm/drop_caches ] ; then
+  COLD_METHOD="drop_caches"
+elif dd if=/dev/null iflag=nocache count=0 2>/dev/null ; then
+  COLD_METHOD="fadvise"
+else
+  COLD_METHOD="none"
+fi
+
+HAS_TIME=""
+[ -x /usr/bin/time ] && /usr/bin/time -f %M -o /dev/null true 2>/dev/null && HAS_TIME="y"
+HAS_STRACE=""
+command -v strace >/dev/null 2>&1 && strace -o /dev/null true 2>/dev/null && HAS_STRACE="y"
+
+#############################################################
+# Generate the scripts: a data table, as generated sources often are
+
+lua_script() {
+  awk -v size="$1" 'BEGIN {
+    print "local data = {"
+    written = 30
+    for (i = 0; written + 80 <= size; i++) {
+      line = sprintf("  { id = %d, name = \"item_%d\", tags = { \"a%d\", \"b%d\" }, value = %d.5 },", i, i, i % 7, i % 11, i)
+      print line
+      written += length(line) + 1
+    }
+    print "}"
+    print "print(#data)"
+  }'
+}
+
+#############################################################
+# Measure
+
+now_ns() {
+  date +%s%N
+}
+
+# Print the min, p50, p90, p99 and max of the times in the file, as a JSON object
+percentiles() {
+  sort -n "$1" | awk '
+    { v[NR] = $1 }
+    function at(p,  i) { i = int((NR - 1) * p + 0.5) + 1; return v[i] }
+    END {
+      if (NR == 0) { printf "null"; exit }
+      printf "{\"min\": %d, \"p50\": %d, \"p90\": %d, \"p99\": %d, \"max\": %d}", v[1], at(0.5), at(0.9), at(0.99), v[NR]
+    }'
+}
+
+drop_cache() {
+  sync
+  case "$COLD_METHOD" in
+    drop_caches) echo 3 > /proc/sys/vm/drop_caches ;;
+    fadvise) dd if="$1" iflag=nocache count=0 2>/dev/null ;;
+  esac
+}
+
+# Launch latency in microseconds, one per line. The time to spawn `date` is
+# included, see the "baseline" entry of the results.
+launch_times() {
+  I=0
+  while [ "$I" -lt "$2" ] ; do
+    [ "$3" = "cold" ] && drop_cache "$1"
+    START=$(now_ns)
+    "$1" > /dev/null
+    STOP=$(now_ns)
+    echo $(( (STOP - START) / 1000 ))
+    I=$((I + 1))
+  done
+}
+
+peak_rss_kb() {
+  if [ -z "$HAS_TIME" ] ; then printf "null" ; return ; fi
+  /usr/bin/time -f %M -o ./rss.txt "$1" > /dev/null
+  printf "%d" "$(tail -n 1 ./rss.txt)"
+}
+
+syscall_count() {
+  if [ -z "$HAS_STRACE" ] ; then printf "null" ; return ; fi
+  strace -f -c -o ./strace.txt "$1" > /dev/null
+  awk '/^-/ { part += 1; next } part == 1 { n += $4 } END { printf "%d", n }' ./strace.txt
+}
+
+RESULTS=""
+add_result() {
+  [ -n "$RESULTS" ] && RESULTS="$RESULTS,"
+  RESULTS="$RESULTS
+    $1"
+}
+
+measure() {
+  EXE="./$1"
+  launch_times "$EXE" "$RUNS" warm > ./warm.txt
+  if [ "$COLD_METHOD" = "none" ] ; then
+    : > ./cold.txt
+  else
+    launch_times "$EXE" "$COLD_RUNS" cold > ./cold.txt
+  fi
+  printf "{\"exe_size\": %d, \"warm_us\": %s, \"cold_us\": %s, \"peak_rss_kb\": %s, \"syscalls\": %s}" \
+    "$(wc -c < "$EXE")" "$(percentiles ./warm.txt)" "$(percentiles ./cold.txt)" "$(peak_rss_kb "$EXE")" "$(syscall_count "$EXE")"
+}
+
+BASELINE="$(launch_times /bin/true "$RUNS" warm > ./warm.txt ; percentiles ./warm.txt)"
+
+for SIZE in $SIZES ; do
+  lua_script "$SIZE" > ./script.lua
+  SCRIPT_SIZE=$(wc -c < ./script.lua)
+  EXPECTED="$(./tail.exe ./script.lua)"
+
+  for RUNTIME in array tail ; do
+    if [ "$RUNTIME" = "array" ] && [ "$SCRIPT_SIZE" -gt "$ARRAY_SIZE" ] ; then continue ; fi
+    for MODE in plain bytecode compressed section ; do
+      case "$MODE" in
+        plain) OPTIONS="{}" ;;
+        bytecode) OPTIONS="{compile = true}" ;;
+        compressed) OPTIONS="{compress = true}" ;;
+        section) OPTIONS="{section = true}" ;;
+      esac
+      PACKED="${RUNTIME}_${MODE}.exe"
+      ./$RUNTIME.exe -e "require'glua_pack'('script.lua', '$PACKED', $OPTIONS)" || exit 1
+      chmod ugo+x "./$PACKED"
+
+      RES="$(./"$PACKED")"
+      if [ "$RES" != "$EXPECTED" ] ; then
+        echo "TEST FAILS ! $PACKED printed >>>$RES<<< instead of >>>$EXPECTED<<<"
+        exit 1
+      fi
+      printf "%-24s %10d byte script\n" "$PACKED" "$SCRIPT_SIZE"
+      add_result "{\"runtime\": \"$RUNTIME\", \"mode\": \"$MODE\", \"script_size\": $SCRIPT_SIZE, \"result\": $(measure "$PACKED")}"
+      rm -f "./$PACKED"
+    done
+  done
+done
+
+cat > "$OUT" << EOF
+{
+  "date": "$(date -u +%Y-%m-%dT%H:%M:%SZ)",
+  "commit": "$(git -C .. rev-parse --short HEAD 2>/dev/null)",
+  "runs": $RUNS,
+  "cold_runs": $COLD_RUNS,
+  "cold_method": "$COLD_METHOD",
+  "baseline_us": $BASELINE,
+  "results": [$RESULTS
+  ]
+}
+EOF
+
+cat "$OUT"
+echo "ALL RIGHT"
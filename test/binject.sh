@@ -5,16 +5,14 @@ echo "Running some tests (note: error states are not currently tested)."
 #############################################################
 # Prepare directory
 
-# Linux
-# SHEXT="so"
-# CC_ARCH_FLAG="-fPIC"
-
-# Windows
-SHEXT="dll"
-CC_ARCH_FLAG=""
+case "$(uname -s)" in
+  MINGW*|MSYS*|CYGWIN*) SHEXT="dll" ; CC_ARCH_FLAG="" ;;
+  *) SHEXT="so" ; CC_ARCH_FLAG="-fPIC" ;;
+esac
 
 TEST_DIR="$(readlink -f "$(dirname "$0")")/tmp"
 CC="gcc -std=c99 -Wall $CC_ARCH_FLAG "
+EXAMPLE="-x c ../../binject_example.cc -x none"
 
 rm -fR "$TEST_DIR"
 mkdir "$TEST_DIR"
@@ -23,10 +21,10 @@ cd "$TEST_DIR"
 #############################################################
 # Compile static
 
-$CC -o ./array_static.exe ../../*.c
+$CC -o ./array_static.exe ../../binject.c $EXAMPLE
 strip ./array_static.exe
 
-$CC -D'BINJECT_ARRAY_SIZE=3' -o ./tail_static.exe ../../*.c
+$CC -D'BINJECT_ARRAY_SIZE=3' -o ./tail_static.exe ../../binject.c $EXAMPLE
 strip ./tail_static.exe
 
 cp ./tail_static.exe ./tail_static_bis.exe
@@ -34,8 +32,8 @@ cp ./tail_static.exe ./tail_static_bis.exe
 #############################################################
 # Compile shared
 
-$CC -shared -fPIC -o ./libbinject_array.$SHEXT ../../binject.c || exit -1
-$CC -o ./array_shared.exe ../../example.c -L ./ -lbinject_array || exit -1
+$CC -shared -fPIC -o ./libbinject_array.$SHEXT ../../binject.c || exit 1
+$CC -o ./array_shared.exe $EXAMPLE -L ./ -lbinject_array || exit 1
 strip ./libbinject_array.$SHEXT
 strip ./array_shared.exe
 
@@ -46,8 +44,6 @@ export LD_LIBRARY_PATH="./"
 #############################################################
 # Test working
 
-SEDSIZCOL='s:^[^ ]* *[^ ]* *[^ ]* *[^ ]* *[^ ]* *\([^ ]*\) *.*$:\1:g'
-
 should_be() {
   if [ "$2" = "=" -a "$1" = "$3" ] ; then return ; fi
   if [ "$2" = "!=" -a "$1" != "$3" ] ; then return ; fi
@@ -56,24 +52,24 @@ should_be() {
   echo "<<< TO BE $2 TO >>>"
   echo "$3"
   echo "<<<"
-  exit -1
+  exit 1
 }
 
 test_working_sequence(){
   TEXT="hello world $1"
 
   # create text to embed
-  echo "$TEXT" > ./"$1".txt || exit -1
+  echo "$TEXT" > ./"$1".txt || exit 1
 
   # embed the text
   echo "------> $1"
-  ./"$1" ./"$1".txt || exit -1
-  mv injed.exe ./"$1".emb || exit -1
-  chmod ugo+x ./"$1".emb || exit -1
+  ./"$1" ./"$1".txt || exit 1
+  mv injed.exe ./"$1".emb || exit 1
+  chmod ugo+x ./"$1".emb || exit 1
 
   # run the app with the embedded text
   echo "------> $1.emb"
-  ./"$1".emb > ./"$1".rpt || exit -1
+  ./"$1".emb > ./"$1".rpt || exit 1
 
   # check output
   LEN="+$TEXT"
@@ -94,17 +90,14 @@ test_working_sequence array_shared_bis.exe
 #############################################################
 # Test Array / Tail method trhough exe size
 
-ls -l > my_size_info.txt
-grep '.exe.emb$' my_size_info.txt
-
-ARRAY=$(grep 'array_shared.exe.emb$' my_size_info.txt | sed "$SEDSIZCOL")
-ARRAYBIS=$(grep 'array_shared_bis.exe.emb$' my_size_info.txt | sed "$SEDSIZCOL")
+ARRAY=$(wc -c < array_shared.exe.emb)
+ARRAYBIS=$(wc -c < array_shared_bis.exe.emb)
 
 # If the array method was chosen, the size of the exe is always the same
 should_be "$ARRAY" = "$ARRAYBIS"
 
-TAIL=$(grep 'tail_static.exe.emb$' my_size_info.txt | sed "$SEDSIZCOL")
-TAILBIS=$(grep 'tail_static_bis.exe.emb$' my_size_info.txt | sed "$SEDSIZCOL")
+TAIL=$(wc -c < tail_static.exe.emb)
+TAILBIS=$(wc -c < tail_static_bis.exe.emb)
 
 # If the tail method was chosen, the size of the exe depend on the embeded script
 should_be "$TAIL" != "$TAILBIS"
@@ -118,6 +111,79 @@ rm *.$SHEXT
 RES=$(cat array_shared.exe.empty.rpt)
 should_be "" = "$RES"
 
+#############################################################
+# Test the footer, through a runner that reads back its payload
+
+$CC -o ./runner_array.exe ../binject_test.c ../../binject.c || exit 1
+$CC -D'BINJECT_ARRAY_SIZE=3' -o ./runner_tail.exe ../binject_test.c ../../binject.c || exit 1
+
+HAS_SECTION=""
+[ "$(uname -s)" = "Linux" ] && HAS_SECTION="y"
+
+# Check the output of a generated binary: method, payload and verify result
+should_dump() {
+  chmod ugo+x ./"$1" || exit 1
+  RES="$(./"$1")"
+  EXP="$(printf 'method %s\n[%s]\nverify %s' "$2" "$3" "$4")"
+  should_be "$EXP" = "$RES"
+}
+
+# Replace the first occurrence of the text in the file
+corrupt() {
+  OFF=$(grep -abo "$2" "$1" | head -n 1 | cut -d: -f1)
+  printf '%s' "$3" | dd of="$1" bs=1 seek="$OFF" conv=notrunc 2>/dev/null || exit 1
+}
+
+printf 'hello binject' > ./p1.txt
+printf 'second payload, longer than the first one' > ./p2.txt
+printf 'short' > ./p3.txt
+awk 'BEGIN { for (i = 0; i < 2000; i++) printf "line %d of the big payload;", i }' > ./big.txt
+BIG="$(cat ./big.txt)"
+
+echo "------> inject, read back and verify"
+./runner_array.exe inject ./p1.txt ./array.emb || exit 1
+should_dump array.emb array "hello binject" 0
+./runner_tail.exe inject ./p1.txt ./tail.emb || exit 1
+should_dump tail.emb tail "hello binject" 0
+./runner_array.exe inject ./big.txt ./array_big.emb chunk=1000 || exit 1
+should_dump array_big.emb tail "$BIG" 0
+./runner_tail.exe inject ./p1.txt ./tail_bytes.emb chunk=1 || exit 1
+should_dump tail_bytes.emb tail "hello binject" 0
+if [ -n "$HAS_SECTION" ] ; then
+  ./runner_tail.exe inject ./p1.txt ./section.emb section || exit 1
+  should_dump section.emb section "hello binject" 0
+fi
+
+echo "------> stages"
+./runner_tail.exe inject ./p1.txt ./upper.emb upper chunk=3 || exit 1
+should_dump upper.emb tail "HELLO BINJECT" 0
+./runner_tail.exe update ./p2.txt ./upper.emb upper || exit 1
+should_dump upper.emb tail "SECOND PAYLOAD, LONGER THAN THE FIRST ONE" 0
+
+echo "------> corrupted payload"
+cp ./tail.emb ./tail_bad.emb
+corrupt ./tail_bad.emb "hello binject" "hello binjecT"
+should_dump tail_bad.emb tail "hello binjecT" -5
+cp ./array.emb ./array_bad.emb
+corrupt ./array_bad.emb "hello binject" "HELLO"
+should_dump array_bad.emb array "HELLO binject" -5
+
+echo "------> update in place"
+./runner_array.exe update ./p2.txt ./array.emb || exit 1
+should_dump array.emb array "second payload, longer than the first one" 0
+./runner_tail.exe update ./p2.txt ./tail.emb || exit 1
+should_dump tail.emb tail "second payload, longer than the first one" 0
+./runner_tail.exe update ./p3.txt ./tail.emb || exit 1
+should_dump tail.emb tail "short" 0
+./runner_tail.exe inject ./p3.txt ./tail_fresh.emb || exit 1
+cmp ./tail.emb ./tail_fresh.emb || exit 1  # the old payload is cut
+./runner_array.exe update ./p1.txt ./array_big.emb || exit 1
+should_dump array_big.emb array "hello binject" 0
+if [ -n "$HAS_SECTION" ] ; then
+  ./runner_tail.exe update ./p2.txt ./section.emb || exit 1
+  should_dump section.emb tail "second payload, longer than the first one" 0
+fi
+
 #############################################################
 # Print succesfull summary
 
@@ -0,0 +1,197 @@
+
+// Micro-benchmark of the binject primitives, on generated files. Besides the
+// API, it times the tag scan declared in binject_internal.h. Compile it with:
+//
+//   gcc -std=gnu99 -O2 -o binject_bench.exe test/binject_bench.c binject.c
+//
+// and run it in a directory where it can write the test files:
+//
+//   ./binject_bench.exe [binary_MB [payload_MB [chunks [repeat]]]]
+//
+// The generated binary has the static data near its end and no footer, so
+// binject_duplicate_binary must scan all of it, as with a fresh runtime.
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "../binject.h"
+#include "../binject_internal.h"
+
+#ifndef BINJECT_ARRAY_SIZE
+#define BINJECT_ARRAY_SIZE (9216)
+#endif // BINJECT_ARRAY_SIZE
+
+#define BENCH_TAG "```replace_data```"
+
+BINJECT_STATIC_STRING(BENCH_TAG, BINJECT_ARRAY_SIZE, static_data);
+
+// Size of the static data, as laid in the binary
+#define STATIC_DATA_SIZE (sizeof(static_data_istance))
+
+// Size of the data after the static one in the generated binary
+#define TRAILER_SIZE (4096)
+
+#define SOURCE_PATH "binject_bench_src.tmp"
+#define DESTINATION_PATH "binject_bench_dst.tmp"
+#define FILL_BLOCK_SIZE (1048576)
+
+static double now_ms(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+// Pseudo random content: the first byte of the tag is found sometimes, as in
+// a real binary
+static void fill(char * buf, size_t size, unsigned int * seed) {
+  for (size_t i = 0; i < size; i++) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    buf[i] = *seed >> 24;
+  }
+}
+
+static int generate_binary(const char * path, long long size, char * buf) {
+  unsigned int seed = 2463534242u;
+  FILE * f = fopen(path, "wb");
+  if (!f) return ACCESS_ERROR;
+  for (long long done = 0; done < size; ) {
+    size_t block = size - done < FILL_BLOCK_SIZE ? size - done : FILL_BLOCK_SIZE;
+    fill(buf, block, &seed);
+    if (block != fwrite(buf, 1, block, f)) break;
+    done += block;
+  }
+  // The static data, as the compiler lays it, with something after it
+  fwrite(&static_data_istance, 1, STATIC_DATA_SIZE, f);
+  fill(buf, TRAILER_SIZE, &seed);
+  fwrite(buf, 1, TRAILER_SIZE, f);
+  return fclose(f) ? ACCESS_ERROR : NO_ERROR;
+}
+
+typedef struct {
+  double min;
+  double total;
+  int count;
+} timing_t;
+
+static void timing_add(timing_t * t, double ms) {
+  if (t->count == 0 || ms < t->min) t->min = ms;
+  t->total += ms;
+  t->count += 1;
+}
+
+// Print the latency of a single call and the throughput on the given bytes
+static void report(const char * name, timing_t * t, int calls, long long bytes) {
+  double avg = t->total / t->count;
+  printf("%-28s %6d %12.3f %12.3f %10.1f\n", name, calls,
+    t->min / calls, avg / calls, bytes / 1048576.0 / (t->min / 1e3));
+}
+
+static int fail(const char * what, int error) {
+  fprintf(stderr, "%s failed: %d", what, error);
+  if (errno) fprintf(stderr, " (%s)", strerror(errno));
+  fprintf(stderr, "\n");
+  remove(SOURCE_PATH);
+  remove(DESTINATION_PATH);
+  return 1;
+}
+
+int main(int argc, char ** argv) {
+  double binary_mb = argc > 1 ? atof(argv[1]) : 64;
+  double payload_mb = argc > 2 ? atof(argv[2]) : 16;
+  int chunks = argc > 3 ? atoi(argv[3]) : 16;
+  int repeat = argc > 4 ? atoi(argv[4]) : 5;
+  if (binary_mb <= 0 || payload_mb <= 0 || chunks <= 0 || repeat <= 0) {
+    printf("\nUsage:\n  %s [binary_MB [payload_MB [chunks [repeat]]]]\n\n", argv[0]);
+    return 1;
+  }
+
+  long long binary_size = binary_mb * 1048576;
+  long long payload_size = payload_mb * 1048576;
+  long long source_size = binary_size + STATIC_DATA_SIZE + TRAILER_SIZE;
+  size_t chunk_size = payload_size / chunks;
+  payload_size = (long long) chunk_size * chunks;
+
+  char * buf = (char *) malloc(FILL_BLOCK_SIZE > payload_size ? FILL_BLOCK_SIZE : payload_size);
+  if (!buf) return fail("allocation", GENERIC_ERROR);
+  int result = generate_binary(SOURCE_PATH, binary_size, buf);
+  if (NO_ERROR != result) return fail("generation", result);
+  unsigned int seed = 88675123u;
+  fill(buf, payload_size, &seed);
+
+  printf("binary %lld byte, payload %lld byte in %d chunks, %d repeats\n",
+    binary_size, payload_size, chunks, repeat);
+  printf("%-28s %6s %12s %12s %10s\n", "primitive", "calls", "min ms/call", "avg ms/call", "MB/s");
+
+  timing_t scan = {0}, duplicate = {0}, step = {0}, writer = {0}, read = {0}, read_chunk = {0};
+  for (int r = 0; r < repeat; r++) {
+
+    // Tag scan of the whole binary
+    FILE * f = fopen(SOURCE_PATH, "rb");
+    if (!f) return fail("open", ACCESS_ERROR);
+    double start = now_ms();
+    long long found = binject_find_last_tag_byte(f, BENCH_TAG, sizeof(BENCH_TAG));
+    timing_add(&scan, now_ms() - start);
+    fclose(f);
+    if (found < binary_size) return fail("binject_find_last_tag_byte", (int) found);
+
+    // Copy with the scan
+    start = now_ms();
+    result = binject_duplicate_binary(static_data, SOURCE_PATH, DESTINATION_PATH);
+    timing_add(&duplicate, now_ms() - start);
+    if (NO_ERROR != result) return fail("binject_duplicate_binary", result);
+
+    // Injection one step per chunk: each one opens the file again
+    start = now_ms();
+    for (int c = 0; c < chunks && NO_ERROR == result; c++)
+      result = binject_step(static_data, DESTINATION_PATH, buf + c * chunk_size, chunk_size);
+    timing_add(&step, now_ms() - start);
+    if (NO_ERROR != result) return fail("binject_step", result);
+
+    // The same injection with a single writer
+    result = binject_duplicate_binary(static_data, SOURCE_PATH, DESTINATION_PATH);
+    if (NO_ERROR != result) return fail("binject_duplicate_binary", result);
+    start = now_ms();
+    binject_writer_t * w = binject_writer_open(static_data, DESTINATION_PATH);
+    if (!w) return fail("binject_writer_open", ACCESS_ERROR);
+    for (int c = 0; c < chunks; c++) binject_writer_write(w, buf + c * chunk_size, chunk_size);
+    result = binject_writer_commit(w);
+    timing_add(&writer, now_ms() - start);
+    if (NO_ERROR != result) return fail("binject_writer", result);
+
+    // Read back the tail script, whole and one chunk per call. It is appended
+    // to the copy of the source.
+    if (payload_size <= BINJECT_ARRAY_SIZE) continue; // the payload is in the array
+    start = now_ms();
+    long long remaining = binject_get_tail_script64(static_data, DESTINATION_PATH, buf, payload_size, source_size);
+    timing_add(&read, now_ms() - start);
+    if (remaining != 0) return fail("binject_get_tail_script64", (int) remaining);
+    start = now_ms();
+    for (int c = 0; c < chunks && remaining >= 0; c++)
+      remaining = binject_get_tail_script64(static_data, DESTINATION_PATH, buf + c * chunk_size, chunk_size, source_size + c * chunk_size);
+    timing_add(&read_chunk, now_ms() - start);
+    if (remaining < 0) return fail("binject_get_tail_script64", (int) remaining);
+  }
+
+  long long scanned = binary_size + STATIC_DATA_SIZE;
+  report("binject_find_last_tag_byte", &scan, 1, scanned);
+  report("binject_duplicate_binary", &duplicate, 1, source_size);
+  report("binject_step", &step, chunks, payload_size);
+  report("binject_writer_write", &writer, chunks, payload_size);
+  if (read.count) {
+    report("binject_get_tail_script", &read, 1, payload_size);
+    report("binject_get_tail_script/chunk", &read_chunk, chunks, payload_size);
+  } else {
+    printf("the payload fits the array: no tail script to read\n");
+  }
+
+  free(buf);
+  remove(SOURCE_PATH);
+  remove(DESTINATION_PATH);
+  return 0;
+}
@@ -0,0 +1,134 @@
+
+// Test runner of test/binject.sh. Without a payload, it generates a copy of
+// itself with the file content injected:
+//
+//   ./binject_test.exe inject script.txt out.exe [section] [upper] [chunk=N]
+//   ./binject_test.exe update script.txt out.exe [upper]
+//
+// "section" moves the tail data in an ELF section, "upper" injects through a
+// stage that changes the text to upper case, "chunk" sets the size of the
+// writes (default 7). "update" replaces the payload of a generated binary in
+// place. With a payload, the binary prints where it was found, the payload
+// and the result of binject_verify_script:
+//
+//   method tail
+//   [hello world]
+//   verify 0
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "../binject.h"
+
+#ifndef BINJECT_ARRAY_SIZE
+#define BINJECT_ARRAY_SIZE (9216)
+#endif // BINJECT_ARRAY_SIZE
+
+BINJECT_STATIC_STRING("```replace_data```", BINJECT_ARRAY_SIZE, static_data);
+
+static int stage_upper(binject_stage_t * stage, const char * data, size_t size){
+  char buf[64];
+  if (!data) return NO_ERROR;
+  while (size > 0) {
+    size_t count = size < sizeof(buf) ? size : sizeof(buf);
+    for (size_t i = 0; i < count; i++) buf[i] = toupper((unsigned char) data[i]);
+    int result = binject_stage_emit(stage, buf, count);
+    if (NO_ERROR != result) return result;
+    data += count;
+    size -= count;
+  }
+  return NO_ERROR;
+}
+
+static int inject(const char * self_path, int argc, char ** argv){
+  int update = !strcmp(argv[1], "update");
+  int section = 0, upper = 0;
+  size_t chunk = 7;
+  for (int i = 4; i < argc; i++) {
+    if (!strcmp(argv[i], "section")) section = 1;
+    else if (!strcmp(argv[i], "upper")) upper = 1;
+    else if (!strncmp(argv[i], "chunk=", 6)) chunk = (size_t) atol(argv[i] + 6);
+  }
+  if (chunk == 0) return GENERIC_ERROR;
+
+  FILE * script = fopen(argv[2], "rb");
+  if (!script) return ACCESS_ERROR;
+  binject_writer_t * writer = NULL;
+  if (update) {
+    writer = binject_writer_open_update(static_data, argv[3]);
+  } else if (NO_ERROR == binject_duplicate_binary(static_data, self_path, argv[3])) {
+    writer = binject_writer_open(static_data, argv[3]);
+  }
+  if (!writer) {
+    fclose(script);
+    return ACCESS_ERROR;
+  }
+  if (upper) binject_writer_add_stage(writer, stage_upper, NULL);
+
+  int result = NO_ERROR;
+  char * buf = (char *) malloc(chunk);
+  size_t size;
+  if (!buf) result = ACCESS_ERROR;
+  while (NO_ERROR == result && 0 < (size = fread(buf, 1, chunk, script)))
+    result = binject_writer_write(writer, buf, size);
+  free(buf);
+  fclose(script);
+  if (NO_ERROR == result) result = binject_writer_commit(writer);
+  else binject_writer_commit(writer);
+
+  if (NO_ERROR == result && section) result = binject_tail_to_section(static_data, argv[3]);
+  return result;
+}
+
+static int dump(const char * self_path){
+  binject_size_t size = 0, offset = 0;
+  char * script = binject_get_static_script64(static_data, &size, &offset);
+  char * copy = NULL;
+  int mapped = 0;
+
+  if (script) {
+    printf("method %s\n", offset ? "section" : "array");
+  } else {
+    printf("method tail\n");
+    script = binject_map_tail_script(static_data, self_path, offset, &size);
+    mapped = script != NULL;
+    if (!script) {
+      long long remaining = binject_get_tail_script64(static_data, self_path, NULL, 0, offset);
+      if (remaining < 0) return (int) remaining;
+      size = remaining;
+      copy = script = (char *) malloc(size + 1);
+      if (!copy || 0 != binject_get_tail_script64(static_data, self_path, copy, size, offset)) {
+        free(copy);
+        return ACCESS_ERROR;
+      }
+    }
+  }
+
+  printf("[");
+  fwrite(script, 1, size, stdout);
+  printf("]\n");
+  printf("verify %d\n", binject_verify_script(static_data, self_path));
+
+  if (mapped) binject_unmap_tail_script(script, size, offset);
+  free(copy);
+  return NO_ERROR;
+}
+
+int main(int argc, char **argv) {
+  binject_size_t size = 0, offset = 0;
+  binject_get_static_script64(static_data, &size, &offset);
+
+  int result;
+  if (size > 0 || offset > 0) {
+    result = dump(argv[0]);
+  } else if (argc >= 4 && (!strcmp(argv[1], "inject") || !strcmp(argv[1], "update"))) {
+    result = inject(argv[0], argc, argv);
+  } else {
+    fprintf(stderr, "Usage: %s inject|update script output [section] [upper] [chunk=N]\n", argv[0]);
+    return 1;
+  }
+  if (NO_ERROR != result) fprintf(stderr, "Error %d\n", result);
+  return NO_ERROR == result ? 0 : 1;
+}
+
@@ -0,0 +1,362 @@
+#!/bin/sh
+
+echo "Running the glua tests (packing options and runtime features)."
+
+#############################################################
+# Configuration
+
+# Directory of a compiled lua source tree: it must contain the headers, lua.c
+# and liblua.a
+LUA_DIR="${LUA_DIR:-$HOME/lua/src}"
+LUA_CLI="${LUA_CLI:-$LUA_DIR/lua.c}"
+LUA_LIB="${LUA_LIB:-$LUA_DIR/liblua.a}"
+
+TEST_DIR="$(readlink -f "$(dirname "$0")")/tmp_glua"
+CC="${CC:-gcc -O2} -I../.. -I$LUA_DIR"
+
+rm -fR "$TEST_DIR"
+mkdir "$TEST_DIR"
+cd "$TEST_DIR"
+
+#############################################################
+# Compile
+
+build() {
+  EXE="$1"
+  shift
+  $CC "$@" -DUSE_WHEREAMI -DENABLE_STANDARD_LUA_CLI="\"$LUA_CLI\"" \
+    -o "./$EXE" ../../*.c $LUA_LIB -pthread -lm -ldl || exit 1
+}
+
+build glua.exe
+
+#############################################################
+# Helpers
+
+should_be() {
+  if [ "$2" = "=" -a "$1" = "$3" ] ; then return ; fi
+  if [ "$2" = "!=" -a "$1" != "$3" ] ; then return ; fi
+  if [ "$2" = "~" ] && printf "%s" "$1" | grep -q -- "$3" ; then return ; fi
+  echo "TEST FAILS ! EXPECTING >>>"
+  echo "$1"
+  echo "<<< TO BE $2 TO >>>"
+  echo "$3"
+  echo "<<<"
+  exit 1
+}
+
+# Pack the script in the executable, with the options (a lua table)
+pack() {
+  ./glua.exe -e "local _, e = require'glua_pack'('$1', '$2', ${3:-nil}) if e then error(e, 0) end" || exit 1
+  chmod ugo+x "./$2"
+}
+
+# A script of about $1 byte that prints the size of its data and its first
+# argument
+lua_script() {
+  awk -v size="$1" 'BEGIN {
+    print "local data = {"
+    for (i = 0; 12 * i < size; i++) printf "  %9d,\n", i
+    print "}"
+    print "print(#data, arg[1])"
+  }'
+}
+
+size_of() {
+  wc -c < "$1" | tr -d ' '
+}
+
+TAB="$(printf '\t')"
+
+#############################################################
+# Embedded scripts: in the internal array, and at the end of the executable
+# also longer than the chunks passed to the lua loader
+
+for SIZE in 100 100000 ; do
+  lua_script $SIZE > ./script_$SIZE.lua
+  COUNT=$(( (SIZE + 11) / 12 ))
+  pack script_$SIZE.lua plain_$SIZE.exe
+  should_be "$(./plain_$SIZE.exe hello)" = "$COUNT${TAB}hello"
+done
+
+#############################################################
+# Bytecode: compiled and stripped at packing
+
+echo 'local function f() error("boom") end f()' > ./error.lua
+
+pack error.lua error_source.exe
+should_be "$(./error_source.exe 2>&1)" "~" '"embedded"\]:1: boom'
+pack error.lua error_compiled.exe "{compile = true}"
+should_be "$(./error_compiled.exe 2>&1)" "~" 'error.lua:1: boom'
+pack error.lua error_stripped.exe "{strip = true}"
+should_be "$(./error_stripped.exe 2>&1)" "~" "${TAB}boom$"
+
+pack script_100000.lua compiled.exe "{compile = true}"
+should_be "$(./compiled.exe hello)" = "$(./plain_100000.exe hello)"
+pack script_100000.lua stripped.exe "{strip = true}"
+should_be "$(./stripped.exe hello)" = "$(./plain_100000.exe hello)"
+should_be "$(size_of stripped.exe)" "!=" "$(size_of compiled.exe)"
+
+#############################################################
+# Compressed payloads
+
+pack script_100000.lua compressed.exe "{compress = true}"
+should_be "$(./compressed.exe hello)" = "$(./plain_100000.exe hello)"
+should_be "$(( $(size_of compressed.exe) < $(size_of plain_100000.exe) ))" = "1"
+pack script_100000.lua compiled_compressed.exe "{compile = true, compress = true}"
+should_be "$(./compiled_compressed.exe hello)" = "$(./plain_100000.exe hello)"
+
+#############################################################
+# Archive: modules found by require in the embedded index
+
+mkdir ./x
+echo 'return "embedded x.a"' > ./x/a.lua
+echo 'return "embedded b"' > ./b.lua
+cat > ./modules.lua << EOF
+print(require "x.a")
+print(require "b")
+print(pcall(require, "missing"))
+EOF
+
+for OPTIONS in "" "compile = true," "compress = true," ; do
+  pack modules.lua modules.exe "{$OPTIONS modules = {['x.a'] = 'x/a.lua', b = 'b.lua'}}"
+  echo 'return "filesystem b"' > ./b.lua
+  RES="$(./modules.exe)"
+  echo 'return "embedded b"' > ./b.lua
+  should_be "$RES" "~" "^embedded x.a"
+  should_be "$RES" "~" "^embedded b"
+  should_be "$RES" "~" "no embedded module 'missing'"
+done
+
+RES="$(./glua.exe -e "print(require'glua_pack'('modules.lua', 'bad.exe', {modules = {a = 'nope.lua'}}))")"
+should_be "$RES" "~" "can not read nope.lua"
+
+#############################################################
+# Startup tracing
+
+GLUA_TRACE=./trace.json ./modules.exe > /dev/null
+RES="$(cat ./trace.json)"
+should_be "$RES" "~" '"traceEvents"'
+should_be "$RES" "~" '"name": "load", "cat": "startup"'
+should_be "$RES" "~" '"name": "run", "cat": "startup"'
+should_be "$RES" "~" '"name": "x.a", "cat": "require"'
+should_be "$(GLUA_TRACE=stderr ./modules.exe 2>&1 >/dev/null)" "~" '"name": "openlibs"'
+
+#############################################################
+# Library selection, and lazy opening
+
+cat > ./libs.lua << EOF
+print(rawget(_G, "math"), math.floor(2.5), rawget(_G, "math") ~= nil)
+print(io, os, pcall(require, "io"))
+EOF
+pack libs.lua libs.exe "{libs = {'math'}}"
+RES="$(./libs.exe)"
+should_be "$RES" "~" "^nil${TAB}2${TAB}true$"
+should_be "$RES" "~" "^nil${TAB}nil${TAB}false"
+
+RES="$(./glua.exe -e "print(require'glua_pack'('libs.lua', 'bad.exe', {libs = {'nope'}}))" 2>&1)"
+should_be "$RES" "~" "unknown standard library 'nope'"
+
+# A strict.lua like metatable of _G sees all the selected libraries opened
+cat > ./strict.lua << EOF
+setmetatable(_G, { __index = function(_, k) error("undefined " .. k, 2) end })
+print(rawget(_G, "math") ~= nil, os ~= nil, pcall(function() return io end))
+EOF
+pack strict.lua strict.exe "{libs = {'math', 'os'}}"
+should_be "$(./strict.exe)" "~" "^true${TAB}true${TAB}false${TAB}.*undefined io"
+
+build glua_lazy.exe -DGLUA_LAZY_LIBS=1
+./glua_lazy.exe -e "require'glua_pack'('libs.lua', 'lazy.exe')" && chmod ugo+x ./lazy.exe
+RES="$(./lazy.exe)"
+should_be "$RES" "~" "^nil${TAB}2${TAB}true$"
+should_be "$RES" "~" "^table: .*${TAB}true${TAB}table: "
+./glua_lazy.exe -e "require'glua_pack'('strict.lua', 'lazy_strict.exe')" && chmod ugo+x ./lazy_strict.exe
+should_be "$(./lazy_strict.exe)" "~" "^true${TAB}true${TAB}true"
+
+#############################################################
+# Pooled allocator
+
+cat > ./alloc.lua << EOF
+local t = {}
+for i = 1, 100000 do t[i] = { i, tostring(i) } end
+for i = 1, 100000, 2 do t[i] = nil end
+collectgarbage()
+local s = 0
+for _, v in pairs(t) do s = s + v[1] + #v[2] end
+print(s, require "glua".memstats().allocator)
+EOF
+pack alloc.lua alloc.exe
+RES="$(GLUA_ALLOC=system ./alloc.exe)"
+should_be "$RES" "~" "${TAB}system$"
+should_be "$(GLUA_ALLOC=pool ./alloc.exe)" = "${RES%"${TAB}system"}${TAB}pool"
+
+#############################################################
+# Memory accounting and limit
+
+cat > ./memory.lua << EOF
+local ok, e = pcall(string.rep, "x", 8 * 1024 * 1024)
+local stats = require "glua".memstats()
+print(ok, ok and #e or e, stats.limit, stats.failures > 0, stats.peak <= stats.limit or stats.limit == 0)
+EOF
+pack memory.lua memory.exe "{memory_limit = 4 * 1024 * 1024}"
+should_be "$(./memory.exe)" = "false${TAB}not enough memory${TAB}4194304${TAB}true${TAB}true"
+should_be "$(GLUA_ALLOC=pool ./memory.exe)" = "false${TAB}not enough memory${TAB}4194304${TAB}true${TAB}true"
+should_be "$(GLUA_MEMORY_LIMIT=64M ./memory.exe)" "~" "^true${TAB}8388608${TAB}67108864${TAB}false${TAB}true$"
+should_be "$(GLUA_MEMORY_LIMIT=0 ./memory.exe)" "~" "^true${TAB}8388608${TAB}0${TAB}false${TAB}true$"
+should_be "$(GLUA_MEMORY_LIMIT=nope ./memory.exe 2>&1)" "~" "GLUA_MEMORY_LIMIT: invalid size nope"
+
+#############################################################
+# Profiler
+
+cat > ./profile.lua << EOF
+local function busy(seconds)
+  local stop = os.clock() + seconds
+  while os.clock() < stop do end
+end
+local profile = require "glua".profile
+busy(0.2)
+local ok, e = profile.start()
+if not ok then print(e) return end
+busy(0.2)
+print(profile.stop())
+EOF
+pack profile.lua profile.exe
+should_be "$(./profile.exe)" "~" "^main chunk (.*);busy (.*) [0-9]*$"
+
+# The whole script is profiled by GLUA_PROFILE, so profile.start fails
+should_be "$(GLUA_PROFILE=./profile.txt ./profile.exe)" = "the profiler is already running"
+should_be "$(cat ./profile.txt)" "~" "^main chunk (.*);busy (.*) [0-9]*$"
+should_be "$(grep -c -v ' [0-9]*$' ./profile.txt)" = "0"
+
+#############################################################
+# Batch packing: the same executables of the single packing
+
+echo 'print("a", arg[1])' > ./a.lua
+echo 'print("b", arg[1])' > ./b.lua
+for THREADS in 1 4 ; do
+  RES="$(./glua.exe -e "
+    local r = require'glua_pack'({
+      {'a.lua', 'batch_a.exe'},
+      {'b.lua', 'batch_b.exe', {compile = true}},
+      {'nope.lua', 'batch_c.exe'},
+    }, {compress = true, threads = $THREADS})
+    print(r[1], r[2], type(r[3]))
+  ")"
+  should_be "$RES" = "true${TAB}true${TAB}string"
+  chmod ugo+x ./batch_a.exe ./batch_b.exe
+  should_be "$(./batch_a.exe 1)" = "a${TAB}1"
+  should_be "$(./batch_b.exe 2)" = "b${TAB}2"
+  pack a.lua single_a.exe "{compress = true}"
+  cmp ./batch_a.exe ./single_a.exe || exit 1
+done
+
+#############################################################
+# Update of an executable generated before
+
+pack a.lua update.exe
+for SCRIPT in b.lua script_100000.lua a.lua ; do
+  pack $SCRIPT update.exe "{update = true}"
+  pack $SCRIPT expected.exe
+  should_be "$(./update.exe x)" = "$(./expected.exe x)"
+done
+pack script_100000.lua update.exe "{update = true, compress = true}"
+should_be "$(./update.exe x)" = "$(./plain_100000.exe x)"
+
+#############################################################
+# Streamed packing of a script larger than the buffers
+
+lua_script 3000000 > ./script_big.lua
+EXPECTED="$(( (3000000 + 11) / 12 ))${TAB}big"
+for OPTIONS in "" "compile = true" "compress = true" "strip = true, compress = true" ; do
+  pack script_big.lua big.exe "{$OPTIONS}"
+  should_be "$(./big.exe big)" = "$EXPECTED"
+done
+
+#############################################################
+# Assets
+
+printf 'hello world\n' > ./t.txt
+awk 'BEGIN { for (i = 0; i < 3000; i++) printf "line %d\n", i }' > ./big.txt
+cat > ./assets.lua << EOF
+local asset = require "glua.asset"
+local view = asset.get("t.txt")
+print(#view, view:sub(1, 5), view:sub(-6, -2), view:byte(1), view:find("world"))
+print(asset.string("t.txt") == "hello world\n", tostring(view) == asset.string("t.txt"), view:find("w.r"))
+print(#asset.get("big.txt"), asset.get("big.txt"):find("line 2999", 1, true))
+local names = asset.list()
+table.sort(names)
+print(table.concat(names, ","), asset.get("nope"))
+print(require "glua".verify("t.txt"))
+EOF
+for OPTIONS in "" "compress = true," ; do
+  pack assets.lua assets.exe "{$OPTIONS assets = {['t.txt'] = 't.txt', ['big.txt'] = 'big.txt'}}"
+  RES="$(./assets.exe)"
+  should_be "$RES" "~" "^12${TAB}hello${TAB}world${TAB}104${TAB}7${TAB}11$"
+  should_be "$RES" "~" "^true${TAB}true${TAB}7${TAB}9$"
+  should_be "$RES" "~" "^$(size_of big.txt)${TAB}$(( $(size_of big.txt) - 9 ))${TAB}"
+  should_be "$RES" "~" "^big.txt,t.txt${TAB}nil${TAB}no embedded asset with this name$"
+  should_be "$RES" "~" "^true$"
+done
+
+#############################################################
+# Embedded filesystem: the assets read by io.open, io.lines, loadfile and
+# dofile, from any directory
+
+mkdir ./vfs
+echo 'return "embedded config"' > ./vfs/config.lua
+printf 'first\nsecond\n' > ./vfs/lines.txt
+cat > ./vfs.lua << EOF
+local dir = arg[0]:match("^(.*/)")
+print(dofile("config.lua"), loadfile("./config.lua")(), dofile(dir .. "config.lua"))
+print(io.open("data/lines.txt"):read("a") == "first\nsecond\n")
+for line in io.lines("data/lines.txt") do print("line", line) end
+print(io.open("missing.txt"))
+print(io.open("data/lines.txt", "w"))
+EOF
+pack vfs.lua vfs.exe "{assets = {['config.lua'] = 'vfs/config.lua', ['data/lines.txt'] = 'vfs/lines.txt'}}"
+rm -fR ./vfs
+RES="$(cd / && "$TEST_DIR/vfs.exe")"
+should_be "$RES" "~" "^embedded config${TAB}embedded config${TAB}embedded config$"
+should_be "$RES" "~" "^true$"
+should_be "$RES" "~" "^line${TAB}second$"
+should_be "$RES" "~" "^nil${TAB}missing.txt: No such file"
+should_be "$RES" "~" "^nil${TAB}data/lines.txt: No such file"
+
+#############################################################
+# Bytecode cache
+
+mkdir ./d1 ./d2 ./cache
+chmod 700 ./cache
+echo 'return "d1"' > ./d1/mod.lua
+echo 'return "d2"' > ./d2/mod.lua
+touch -r ./d1/mod.lua ./d2/mod.lua
+echo 'package.path = "./?.lua" print(require "mod", dofile("mod.lua"))' > ./cached.lua
+pack cached.lua cached.exe
+
+RES="$(cd ./d1 && GLUA_CACHE_DIR=../cache ../cached.exe)"
+should_be "$RES" = "d1${TAB}d1"
+should_be "$(ls ./cache | wc -l | tr -d ' ')" = "1"
+
+# The cache is keyed by the canonical path: same name, size and time
+RES="$(cd ./d2 && GLUA_CACHE_DIR=../cache ../cached.exe)"
+should_be "$RES" = "d2${TAB}d2"
+
+# With the same size and time the cached chunk is used, otherwise it is not
+cp -p ./d1/mod.lua ./mod.ref
+echo 'return "D1"' > ./d1/mod.lua
+touch -r ./mod.ref ./d1/mod.lua
+should_be "$(cd ./d1 && GLUA_CACHE_DIR=../cache ../cached.exe)" = "d1${TAB}d1"
+echo 'return "new d1"' > ./d1/mod.lua
+should_be "$(cd ./d1 && GLUA_CACHE_DIR=../cache ../cached.exe)" = "new d1${TAB}new d1"
+should_be "$(cd ./d1 && ../cached.exe)" = "new d1${TAB}new d1"
+
+# A directory writable by the others is not trusted
+chmod 777 ./cache
+RES="$(cd ./d1 && GLUA_CACHE_DIR=../cache ../cached.exe 2>&1)"
+should_be "$RES" "~" "the cache is disabled"
+should_be "$RES" "~" "^new d1${TAB}new d1$"
+chmod 700 ./cache
+
+#############################################################
+
+echo "ALL RIGHT"